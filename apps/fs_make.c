@@ -0,0 +1,269 @@
+#define _GNU_SOURCE /* for fallocate() */
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Largest original ECS150FS image */
+#define FS_DATA_MAX 8192
+/* Largest extended ECS150FX images, per FAT width */
+#define FX16_DATA_MAX 0xFFFF
+#define FX32_DATA_MAX 0x0FFFFFFF
+
+/* Extended format feature flags, as libfs defines them */
+static const struct {
+	const char *name;
+	uint32_t flag;
+} features[] = {
+	{ "small",	0x1 },
+	{ "compress",	0x2 },
+	{ "dedup",	0x4 },
+	{ "sparse",	0x8 },
+	{ "clones",	0x10 },
+};
+/* Features keeping a refcount table after the FAT */
+#define FEATURE_REFS (0x4 | 0x10)
+/* Refcount table entries per block */
+#define REFS_SIZE (BLOCK_SIZE / 2)
+
+struct superblock {
+	char signature[8];
+	uint16_t total_blocks;
+	uint16_t root_index;
+	uint16_t data_start;
+	uint16_t data_blocks;
+	uint8_t fat_blocks;
+	/* ECS150FX only */
+	uint8_t fat_width;
+	uint32_t total_blocks32;
+	uint32_t root_index32;
+	uint32_t data_start32;
+	uint32_t data_blocks32;
+	uint32_t fat_blocks32;
+	uint32_t dir_blocks32;
+	uint32_t features;
+	uint32_t ref_blocks32;
+	uint32_t block_size32;
+	uint8_t padding[4042];
+} __attribute__((packed));
+
+struct layout {
+	int extended;
+	unsigned int fat_width;
+	size_t block_size;
+	size_t data_blocks;
+	size_t fat_blocks;
+	size_t ref_blocks;
+	size_t dir_blocks;
+	uint32_t features;
+};
+
+static inline size_t div_round_up(size_t a, size_t b)
+{
+	return (a + b - 1) / b;
+}
+
+void usage(char *program)
+{
+	size_t i;
+
+	fprintf(stderr, "Usage: %s [-w <fat width>] [-b <block size>] "
+		"[-d <directory blocks>] [-f <feature>[,<feature>...]] [-p] "
+		"<diskname> <data block count>\n", program);
+	fprintf(stderr, "\t-w\tFAT entry width, 16 or 32\n");
+	fprintf(stderr, "\t-b\tblock size in bytes, a power of two from %d "
+		"to %d\n", BLOCK_SIZE, BLOCK_SIZE_MAX);
+	fprintf(stderr, "\t-d\troot directory length in blocks\n");
+	fprintf(stderr, "\t-f\tfeatures:");
+	for (i = 0; i < ARRAY_SIZE(features); i++)
+		fprintf(stderr, " %s", features[i].name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t-p\tpreallocate the whole image rather than "
+		"leaving it sparse\n");
+	fprintf(stderr, "Any of -w, -b, -d or -f, or more than %d data blocks, "
+		"makes an extended (ECS150FX) image.\n", FS_DATA_MAX);
+	exit(1);
+}
+
+static uint32_t parse_features(char *list)
+{
+	uint32_t flags = 0;
+	char *name;
+	size_t i;
+
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		for (i = 0; i < ARRAY_SIZE(features); i++)
+			if (!strcmp(name, features[i].name))
+				break;
+		if (i == ARRAY_SIZE(features))
+			die("unknown feature '%s'", name);
+		flags |= features[i].flag;
+	}
+	return flags;
+}
+
+static size_t parse_count(const char *arg, const char *what)
+{
+	char *end;
+	long long n = strtoll(arg, &end, 0);
+
+	if (*arg == '\0' || *end != '\0' || n < 1)
+		die("invalid %s '%s'", what, arg);
+	return n;
+}
+
+static void plan_layout(struct layout *l)
+{
+	size_t data_max;
+
+	if (!l->extended) {
+		if (l->data_blocks > FS_DATA_MAX)
+			die("data block count invalid, range is [1, %d]",
+			    FS_DATA_MAX);
+		l->fat_blocks = div_round_up(l->data_blocks * 2, BLOCK_SIZE);
+		return;
+	}
+
+	if (l->fat_width != 16 && l->fat_width != 32)
+		die("FAT width invalid, must be 16 or 32");
+	if (l->block_size < BLOCK_SIZE || l->block_size > BLOCK_SIZE_MAX ||
+	    (l->block_size & (l->block_size - 1)))
+		die("block size invalid, must be a power of two in [%d, %d]",
+		    BLOCK_SIZE, BLOCK_SIZE_MAX);
+	if (l->features && l->block_size != BLOCK_SIZE)
+		die("features need %d byte blocks", BLOCK_SIZE);
+	data_max = l->fat_width == 16 ? FX16_DATA_MAX : FX32_DATA_MAX;
+	if (l->data_blocks > data_max)
+		die("data block count invalid, range is [1, %zu]", data_max);
+
+	l->fat_blocks = div_round_up(l->data_blocks,
+				     l->block_size * 8 / l->fat_width);
+	if (l->features & FEATURE_REFS)
+		l->ref_blocks = div_round_up(l->data_blocks, REFS_SIZE);
+}
+
+static void fill_superblock(struct superblock *sb, const struct layout *l)
+{
+	size_t root_index = 1 + l->fat_blocks + l->ref_blocks;
+	size_t data_start = root_index + l->dir_blocks;
+
+	memset(sb, 0, sizeof(*sb));
+	if (!l->extended) {
+		memcpy(sb->signature, "ECS150FS", 8);
+		sb->total_blocks = data_start + l->data_blocks;
+		sb->root_index = root_index;
+		sb->data_start = data_start;
+		sb->data_blocks = l->data_blocks;
+		sb->fat_blocks = l->fat_blocks;
+		return;
+	}
+
+	memcpy(sb->signature, "ECS150FX", 8);
+	sb->fat_width = l->fat_width;
+	sb->total_blocks32 = data_start + l->data_blocks;
+	sb->root_index32 = root_index;
+	sb->data_start32 = data_start;
+	sb->data_blocks32 = l->data_blocks;
+	sb->fat_blocks32 = l->fat_blocks;
+	sb->dir_blocks32 = l->dir_blocks;
+	sb->features = l->features;
+	sb->ref_blocks32 = l->ref_blocks;
+	if (l->block_size != BLOCK_SIZE)
+		sb->block_size32 = l->block_size;
+}
+
+int main(int argc, char **argv)
+{
+	struct layout l = {
+		.fat_width = 16, .block_size = BLOCK_SIZE, .dir_blocks = 1
+	};
+	static struct superblock sb;
+	static uint8_t fat[BLOCK_SIZE];
+	int preallocate = 0;
+	char *diskname;
+	off_t size;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "w:b:d:f:p")) != -1) {
+		switch (opt) {
+		case 'w':
+			l.fat_width = parse_count(optarg, "FAT width");
+			l.extended = 1;
+			break;
+		case 'b':
+			l.block_size = parse_count(optarg, "block size");
+			l.extended = 1;
+			break;
+		case 'd':
+			l.dir_blocks = parse_count(optarg, "directory length");
+			l.extended = 1;
+			break;
+		case 'f':
+			l.features = parse_features(optarg);
+			l.extended = 1;
+			break;
+		case 'p':
+			preallocate = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	diskname = argv[optind];
+	l.data_blocks = parse_count(argv[optind + 1], "data block count");
+	if (l.data_blocks > FS_DATA_MAX)
+		l.extended = 1;
+	plan_layout(&l);
+	fill_superblock(&sb, &l);
+
+	/*
+	 * Everything but the superblock and the first FAT entry (reserved, set
+	 * to end-of-chain) is zero, so the image is made of holes: only two
+	 * blocks are written whatever its size.
+	 */
+	size = (off_t)(1 + l.fat_blocks + l.ref_blocks + l.dir_blocks +
+		       l.data_blocks) * l.block_size;
+	memset(fat, 0xFF, l.fat_width / 8);
+
+	fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+	if (ftruncate(fd, size))
+		die_perror("ftruncate");
+	if (preallocate && fallocate(fd, 0, 0, size))
+		die_perror("fallocate");
+	if (pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+	    pwrite(fd, fat, sizeof(fat), l.block_size) != sizeof(fat))
+		die_perror("pwrite");
+	if (close(fd))
+		die_perror("close");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       l.data_blocks);
+	return 0;
+}
@@ -0,0 +1,672 @@
+#define _GNU_SOURCE /* for accept4() and pipe2() */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#include "fsd.h"
+
+#define fsd_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsd_error(__VA_ARGS__);		\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Bytes read from a client at once, on top of room for a whole request */
+#define FSD_READ_CHUNK (64 * 1024)
+
+/*
+ * Each client is served by a thread of its own, which reads whatever
+ * requests have arrived, runs them in order, and sends all their responses
+ * in one go before waiting for more. The file system calls of all threads
+ * are serialized by libfs itself.
+ */
+
+struct buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct conn {
+	int sock;
+	int hello;		/* FSD_HELLO accepted */
+	int passed_fd;		/* received with the last read, or -1 */
+	char *shared;		/* shared buffer, or NULL */
+	size_t shared_size;
+	int *fds;		/* file descriptors opened by this client */
+	size_t nfds;
+	size_t fds_cap;
+	struct buffer in;
+	struct buffer out;
+	struct conn *next;
+};
+
+static struct stat image;
+static struct conn *conns;
+static size_t active;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_done = PTHREAD_COND_INITIALIZER;
+/* fs_info(), fs_ls() and fs_check() print to stdout, captured one at a time */
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stop_pipe[2];
+
+static int buffer_reserve(struct buffer *b, size_t len)
+{
+	size_t cap = b->cap ? b->cap : FSD_READ_CHUNK;
+	char *data;
+
+	if (b->len + len <= b->cap)
+		return 0;
+	while (cap < b->len + len)
+		cap *= 2;
+	data = realloc(b->data, cap);
+	if (!data)
+		return -1;
+	b->data = data;
+	b->cap = cap;
+	return 0;
+}
+
+static int buffer_append(struct buffer *b, const void *data, size_t len)
+{
+	if (buffer_reserve(b, len))
+		return -1;
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+static int respond(struct conn *c, uint32_t tag, int ret, const void *payload,
+		   uint32_t length)
+{
+	struct fsd_response resp = { .tag = tag, .ret = ret, .length = length };
+
+	if (buffer_append(&c->out, &resp, sizeof(resp)))
+		return -1;
+	return buffer_append(&c->out, payload, length);
+}
+
+static int flush_out(struct conn *c)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < c->out.len) {
+		n = send(c->sock, c->out.data + done, c->out.len - done,
+			 MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	c->out.len = 0;
+	return 0;
+}
+
+/* Run @call with what it prints to stdout going to @text instead */
+static int capture(int (*call)(void), char **text, size_t *len)
+{
+	FILE *saved;
+	int ret;
+
+	pthread_mutex_lock(&print_lock);
+	fflush(stdout);
+	saved = stdout;
+	stdout = open_memstream(text, len);
+	if (!stdout) {
+		stdout = saved;
+		pthread_mutex_unlock(&print_lock);
+		return -1;
+	}
+	ret = call();
+	fclose(stdout);
+	stdout = saved;
+	pthread_mutex_unlock(&print_lock);
+	return ret;
+}
+
+static int owns_fd(struct conn *c, int fd)
+{
+	size_t i;
+
+	for (i = 0; i < c->nfds; i++)
+		if (c->fds[i] == fd)
+			return 1;
+	return 0;
+}
+
+static int track_fd(struct conn *c, int fd)
+{
+	int *fds;
+
+	if (c->nfds == c->fds_cap) {
+		c->fds_cap = c->fds_cap ? c->fds_cap * 2 : 16;
+		fds = realloc(c->fds, c->fds_cap * sizeof(*fds));
+		if (!fds)
+			return -1;
+		c->fds = fds;
+	}
+	c->fds[c->nfds++] = fd;
+	return 0;
+}
+
+static void untrack_fd(struct conn *c, int fd)
+{
+	size_t i;
+
+	for (i = 0; i < c->nfds; i++) {
+		if (c->fds[i] == fd) {
+			c->fds[i] = c->fds[--c->nfds];
+			return;
+		}
+	}
+}
+
+/* @count bytes of the shared buffer at @offset, or NULL if out of bounds */
+static char *shared_data(struct conn *c, const struct fsd_request *req)
+{
+	if (!c->shared || req->offset > c->shared_size ||
+	    req->count > c->shared_size - req->offset)
+		return NULL;
+	return c->shared + req->offset;
+}
+
+/* Whether @payload holds @names NUL-terminated strings */
+static int valid_names(const char *payload, uint32_t length, int names)
+{
+	const char *end = payload + length, *p = payload;
+
+	while (names--) {
+		p = memchr(p, '\0', end - p);
+		if (!p)
+			return 0;
+		p++;
+	}
+	return 1;
+}
+
+static int hello(struct conn *c, const struct fsd_request *req,
+		 const char *payload)
+{
+	struct stat st;
+
+	if (c->hello || !valid_names(payload, req->length, 1) ||
+	    stat(payload, &st) ||
+	    st.st_dev != image.st_dev || st.st_ino != image.st_ino)
+		return -1;
+
+	if (c->passed_fd >= 0 && req->count) {
+		int seals = fcntl(c->passed_fd, F_GET_SEALS);
+
+		/* a mapping past the end of the memory, or a client shrinking
+		 * it later, would fault the whole server */
+		if (seals < 0 || !(seals & F_SEAL_SHRINK) ||
+		    fstat(c->passed_fd, &st) || st.st_size < 0 ||
+		    (uint64_t)st.st_size < req->count)
+			return -1;
+		c->shared = mmap(NULL, req->count, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, c->passed_fd, 0);
+		if (c->shared == MAP_FAILED) {
+			c->shared = NULL;
+			return -1;
+		}
+		c->shared_size = req->count;
+	}
+	c->hello = 1;
+	return 0;
+}
+
+static int read_request(struct conn *c, const struct fsd_request *req)
+{
+	struct fsd_response resp = { .tag = req->tag };
+	char *data;
+	size_t at;
+	int ret;
+
+	if (req->flags & FSD_SHARED) {
+		data = shared_data(c, req);
+		ret = data ? fs_read(req->fd, data, req->count) : -1;
+		return respond(c, req->tag, ret, NULL, 0);
+	}
+
+	/* read straight into the response, and fill its header in after */
+	if (req->count > FSD_PAYLOAD_MAX ||
+	    buffer_reserve(&c->out, sizeof(resp) + req->count))
+		return respond(c, req->tag, -1, NULL, 0);
+	at = c->out.len;
+	ret = fs_read(req->fd, c->out.data + at + sizeof(resp), req->count);
+	resp.ret = ret;
+	resp.length = ret > 0 ? ret : 0;
+	memcpy(c->out.data + at, &resp, sizeof(resp));
+	c->out.len += sizeof(resp) + resp.length;
+	return 0;
+}
+
+/* The range is mapped on this side only for as long as it is sent */
+static int mmap_request(struct conn *c, const struct fsd_request *req)
+{
+	const void *data = NULL;
+	int ret;
+
+	if (req->count <= FSD_PAYLOAD_MAX)
+		data = fs_mmap(req->fd, req->offset, req->count);
+	if (!data)
+		return respond(c, req->tag, -1, NULL, 0);
+	ret = respond(c, req->tag, req->count, data, req->count);
+	fs_munmap(data);
+	return ret;
+}
+
+static int readdir_request(struct conn *c, const struct fsd_request *req)
+{
+	size_t max = (FSD_PAYLOAD_MAX - sizeof(uint64_t)) /
+		     sizeof(struct fs_dirent);
+	size_t count = req->count < max ? req->count : max;
+	size_t cursor = req->offset;
+	struct fs_dirent *entries;
+	uint64_t next;
+	int ret;
+
+	entries = malloc(sizeof(next) + count * sizeof(*entries));
+	if (!entries)
+		return respond(c, req->tag, -1, NULL, 0);
+	ret = fs_readdir(&cursor, (struct fs_dirent *)((char *)entries +
+						       sizeof(next)), count);
+	next = cursor;
+	memcpy(entries, &next, sizeof(next));
+	ret = respond(c, req->tag, ret, entries,
+		      ret < 0 ? 0 : sizeof(next) + ret * sizeof(*entries));
+	free(entries);
+	return ret;
+}
+
+static int stat_names_request(struct conn *c, const struct fsd_request *req,
+			      const char *payload)
+{
+	const char **names;
+	struct fs_dirent *entries;
+	const char *p = payload;
+	uint32_t i;
+	int ret = -1;
+
+	if (req->count > FSD_PAYLOAD_MAX / sizeof(*entries) ||
+	    !valid_names(payload, req->length, req->count))
+		return respond(c, req->tag, -1, NULL, 0);
+
+	names = malloc(req->count * sizeof(*names));
+	entries = malloc(req->count * sizeof(*entries));
+	if (names && entries) {
+		for (i = 0; i < req->count; i++) {
+			names[i] = p;
+			p += strlen(p) + 1;
+		}
+		ret = fs_stat_names(names, entries, req->count);
+	}
+	ret = respond(c, req->tag, ret, entries,
+		      ret < 0 ? 0 : req->count * sizeof(*entries));
+	free(names);
+	free(entries);
+	return ret;
+}
+
+static int serve(struct conn *c, const struct fsd_request *req,
+		 const char *payload)
+{
+	int (*print_call)(void) = NULL;
+	const char *data;
+	char *text = NULL;
+	size_t len = 0;
+	int ret = -1;
+
+	if (req->op == FSD_HELLO)
+		return respond(c, req->tag, hello(c, req, payload), NULL, 0);
+	if (!c->hello)
+		return -1;
+
+	switch (req->op) {
+	case FSD_INFO:
+		print_call = fs_info;
+		break;
+	case FSD_LS:
+		print_call = fs_ls;
+		break;
+	case FSD_CHECK:
+		print_call = fs_check;
+		break;
+	case FSD_CREATE:
+		if (valid_names(payload, req->length, 1))
+			ret = fs_create(payload);
+		break;
+	case FSD_DELETE:
+		if (valid_names(payload, req->length, 1))
+			ret = fs_delete(payload);
+		break;
+	case FSD_CLONE:
+		if (valid_names(payload, req->length, 2))
+			ret = fs_clone(payload, payload + strlen(payload) + 1);
+		break;
+	case FSD_OPEN:
+		if (valid_names(payload, req->length, 1)) {
+			ret = fs_open(payload);
+			if (ret >= 0 && track_fd(c, ret)) {
+				fs_close(ret);
+				ret = -1;
+			}
+		}
+		break;
+	case FSD_SYNC:
+		ret = fs_sync();
+		break;
+	case FSD_READDIR:
+		return readdir_request(c, req);
+	case FSD_STAT_NAMES:
+		return stat_names_request(c, req, payload);
+	default:
+		break;
+	}
+
+	if (print_call) {
+		ret = capture(print_call, &text, &len);
+		ret = respond(c, req->tag, ret, text, len);
+		free(text);
+		return ret;
+	}
+	if (req->op < FSD_CLOSE || req->op == FSD_SYNC || req->op >= FSD_OP_COUNT)
+		return respond(c, req->tag, ret, NULL, 0);
+
+	/* descriptor calls, on descriptors of this client only */
+	if (!owns_fd(c, req->fd))
+		return respond(c, req->tag, -1, NULL, 0);
+
+	switch (req->op) {
+	case FSD_CLOSE:
+		ret = fs_close(req->fd);
+		if (!ret)
+			untrack_fd(c, req->fd);
+		break;
+	case FSD_STAT:
+		ret = fs_stat(req->fd);
+		break;
+	case FSD_LSEEK:
+		ret = fs_lseek(req->fd, req->offset);
+		break;
+	case FSD_WRITE:
+	case FSD_APPEND:
+		if (req->flags & FSD_SHARED)
+			data = shared_data(c, req);
+		else
+			data = req->count <= req->length ? payload : NULL;
+		if (!data)
+			ret = -1;
+		else if (req->op == FSD_APPEND)
+			ret = fs_append(req->fd, (void *)data, req->count);
+		else
+			ret = fs_write(req->fd, (void *)data, req->count);
+		break;
+	case FSD_READ:
+		return read_request(c, req);
+	case FSD_MMAP:
+		return mmap_request(c, req);
+	case FSD_TRUNCATE:
+		ret = fs_truncate(req->fd, req->offset);
+		break;
+	case FSD_FALLOCATE:
+		ret = fs_fallocate(req->fd, req->offset);
+		break;
+	}
+	return respond(c, req->tag, ret, NULL, 0);
+}
+
+/* Read what the client sent, with the file descriptor it may pass along */
+static ssize_t receive(struct conn *c)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base = c->in.data + c->in.len,
+		.iov_len = c->in.cap - c->in.len,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	do {
+		n = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		if (c->passed_fd >= 0)
+			close(c->passed_fd);
+		memcpy(&c->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return n;
+}
+
+static void serve_conn(struct conn *c)
+{
+	struct fsd_request req;
+	size_t pos;
+	ssize_t n;
+
+	if (buffer_reserve(&c->in, sizeof(req) + FSD_PAYLOAD_MAX +
+			   FSD_READ_CHUNK))
+		return;
+
+	for (;;) {
+		n = receive(c);
+		if (n <= 0)
+			return;
+		c->in.len += n;
+
+		for (pos = 0; c->in.len - pos >= sizeof(req);) {
+			memcpy(&req, c->in.data + pos, sizeof(req));
+			if (req.magic != FSD_MAGIC ||
+			    req.length > FSD_PAYLOAD_MAX)
+				return;
+			if (c->in.len - pos < sizeof(req) + req.length)
+				break;
+			if (serve(c, &req, c->in.data + pos + sizeof(req)))
+				return;
+			pos += sizeof(req) + req.length;
+			if (c->out.len >= FSD_PAYLOAD_MAX && flush_out(c))
+				return;
+
+			/* only the HELLO request may pass a descriptor */
+			if (c->passed_fd >= 0) {
+				close(c->passed_fd);
+				c->passed_fd = -1;
+			}
+		}
+		memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+		c->in.len -= pos;
+
+		if (flush_out(c))
+			return;
+	}
+}
+
+static void conn_free(struct conn *c)
+{
+	struct conn **p;
+	size_t i;
+
+	for (i = 0; i < c->nfds; i++)
+		fs_close(c->fds[i]);
+	if (c->shared)
+		munmap(c->shared, c->shared_size);
+	if (c->passed_fd >= 0)
+		close(c->passed_fd);
+	close(c->sock);
+	free(c->fds);
+	free(c->in.data);
+	free(c->out.data);
+
+	pthread_mutex_lock(&conns_lock);
+	for (p = &conns; *p != c; p = &(*p)->next)
+		;
+	*p = c->next;
+	active--;
+	pthread_cond_signal(&conns_done);
+	pthread_mutex_unlock(&conns_lock);
+	free(c);
+}
+
+static void *conn_thread(void *arg)
+{
+	struct conn *c = arg;
+
+	serve_conn(c);
+	conn_free(c);
+	return NULL;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	if (write(stop_pipe[1], "", 1) < 0)
+		return;
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("socket path too long: '%s'", path);
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("socket");
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		die_perror("bind");
+	if (listen(sock, SOMAXCONN))
+		die_perror("listen");
+	return sock;
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-s <socket>] <diskname>\n", program);
+	fprintf(stderr, "\t-s\tsocket path (default: $FSD_SOCKET, or %s)\n",
+		FSD_SOCKET_DEFAULT);
+	fprintf(stderr, "Serves the file system until SIGINT or SIGTERM.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = on_signal };
+	const char *path = getenv("FSD_SOCKET");
+	struct pollfd pfd[2];
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct conn *c;
+	int sock, client, opt;
+
+	if (!path)
+		path = FSD_SOCKET_DEFAULT;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		if (opt == 's')
+			path = optarg;
+		else
+			usage(argv[0]);
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	if (fs_mount(argv[optind]))
+		die("Cannot mount diskname");
+	if (stat(argv[optind], &image))
+		die_perror("stat");
+
+	if (pipe2(stop_pipe, O_CLOEXEC))
+		die_perror("pipe2");
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	sock = listen_on(path);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	fprintf(stderr, "fsd: serving '%s' on '%s'\n", argv[optind], path);
+
+	pfd[0] = (struct pollfd){ .fd = sock, .events = POLLIN };
+	pfd[1] = (struct pollfd){ .fd = stop_pipe[0], .events = POLLIN };
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("poll");
+		}
+		if (pfd[1].revents)
+			break;
+
+		client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0)
+			continue;
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(client);
+			continue;
+		}
+		c->sock = client;
+		c->passed_fd = -1;
+
+		pthread_mutex_lock(&conns_lock);
+		c->next = conns;
+		conns = c;
+		active++;
+		pthread_mutex_unlock(&conns_lock);
+		if (pthread_create(&thread, &attr, conn_thread, c))
+			conn_free(c);
+	}
+
+	/* end every connection, and wait for their descriptors to be closed */
+	pthread_mutex_lock(&conns_lock);
+	for (c = conns; c; c = c->next)
+		shutdown(c->sock, SHUT_RDWR);
+	while (active)
+		pthread_cond_wait(&conns_done, &conns_lock);
+	pthread_mutex_unlock(&conns_lock);
+
+	close(sock);
+	unlink(path);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	return 0;
+}
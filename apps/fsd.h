@@ -0,0 +1,84 @@
+#ifndef _FSD_H
+#define _FSD_H
+
+#include <stdint.h>
+
+/*
+ * fsd protocol
+ *
+ * fsd mounts one image and serves the fs.h API over a Unix stream socket.
+ * A client sends requests, each a struct fsd_request followed by its
+ * payload, and gets back one struct fsd_response per request, followed by
+ * its payload, in the order the requests were sent. Requests can be
+ * pipelined: a client may send any number of them before reading the
+ * responses, and the server answers a whole batch with a single write.
+ *
+ * The first request of a connection is FSD_HELLO, naming the image the
+ * client expects (its fs_mount() argument). It may carry a file descriptor
+ * of shared memory (SCM_RIGHTS), of @count bytes, which later FSD_WRITE and
+ * FSD_READ requests flagged FSD_SHARED use for their data instead of the
+ * socket: the data is at @offset in the shared buffer.
+ *
+ * File descriptors belong to the connection that opened them, and are closed
+ * by the server when it ends.
+ */
+
+#define FSD_MAGIC 0x31445346 /* "FSD1" */
+
+/* Default socket path, unless FSD_SOCKET is set */
+#define FSD_SOCKET_DEFAULT "fsd.sock"
+
+/* Largest payload of a request or a response */
+#define FSD_PAYLOAD_MAX (1 << 20)
+/* Data up to this length goes through the socket even with a shared buffer */
+#define FSD_INLINE_MAX 4096
+
+enum fsd_op {
+	FSD_HELLO,	/* payload: image name; @count: shared buffer size */
+	FSD_INFO,	/* response payload: what fs_info() prints */
+	FSD_LS,		/* response payload: what fs_ls() prints */
+	FSD_CHECK,	/* response payload: what fs_check() prints */
+	FSD_CREATE,	/* payload: file name */
+	FSD_DELETE,	/* payload: file name */
+	FSD_CLONE,	/* payload: source and destination names */
+	FSD_OPEN,	/* payload: file name */
+	FSD_CLOSE,
+	FSD_STAT,
+	FSD_LSEEK,	/* @offset: new file offset */
+	FSD_WRITE,	/* payload or shared buffer: @count bytes */
+	FSD_READ,	/* response payload or shared buffer: up to @count bytes */
+	FSD_TRUNCATE,	/* @offset: new size */
+	FSD_FALLOCATE,	/* @offset: size */
+	FSD_SYNC,
+	FSD_APPEND,	/* payload or shared buffer: @count bytes */
+	FSD_READDIR,	/* @offset: cursor; @count: most entries; response
+			 * payload: new cursor (uint64_t), struct fs_dirent[] */
+	FSD_STAT_NAMES,	/* payload: @count file names; response payload:
+			 * struct fs_dirent[@count] */
+	FSD_MMAP,	/* @offset: file offset; response payload: the @count
+			 * bytes there, the file offset staying put */
+	FSD_OP_COUNT
+};
+
+/* Request flag: the data is in the shared buffer, at @offset */
+#define FSD_SHARED 0x1
+
+struct fsd_request {
+	uint32_t magic;
+	uint32_t tag;		/* echoed in the response */
+	uint8_t op;		/* enum fsd_op */
+	uint8_t flags;		/* FSD_* flags */
+	uint16_t reserved;
+	int32_t fd;
+	uint32_t count;		/* data bytes */
+	uint32_t length;	/* payload bytes following */
+	uint64_t offset;
+} __attribute__((packed));
+
+struct fsd_response {
+	uint32_t tag;
+	int32_t ret;		/* return value of the fs_*() call */
+	uint32_t length;	/* payload bytes following */
+} __attribute__((packed));
+
+#endif /* _FSD_H */
@@ -0,0 +1,617 @@
+#define _GNU_SOURCE /* for memfd_create() */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#include "fsd.h"
+
+/*
+ * fs.h API over an fsd socket
+ *
+ * Linked instead of libfs, this makes a program a client of fsd: fs_mount()
+ * connects to the server at $FSD_SOCKET (or FSD_SOCKET_DEFAULT), which must
+ * be serving the same image, and fs_umount() disconnects. Bulk data goes
+ * through a shared memory buffer set up at connection time, and large reads
+ * are split into pieces requested all at once. Calls from several threads
+ * are serialized. fs_mmap() always copies the range into a buffer of the
+ * client, kept until fs_munmap() or fs_umount().
+ */
+
+/* Shared buffer size */
+#define CLIENT_SHARED_SIZE (4 << 20)
+/* Most requests sent before reading their responses */
+#define CLIENT_PIPELINE 8
+
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sock = -1;
+static char *shared;
+static size_t shared_size;
+static uint32_t next_tag;
+static int open_count;
+
+/* Range copied by fs_mmap() */
+struct mapping {
+	struct mapping *next;
+	char data[];
+};
+
+static struct mapping *mappings;
+
+static int send_all(struct iovec *iov, int iovcnt, int pass_fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	if (pass_fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+
+	while (msg.msg_iovlen > 0) {
+		n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+
+		/* skip what was sent */
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int recv_all(void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = recv(sock, (char *)buf + done, len - done, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Receive a response, its payload going to @buf, which holds @max bytes.
+ * Returns -1 if the connection fails, otherwise the call's return value.
+ */
+static int receive(void *buf, size_t max, uint32_t *length)
+{
+	struct fsd_response resp;
+
+	if (recv_all(&resp, sizeof(resp)) || resp.length > max ||
+	    recv_all(buf, resp.length))
+		return -1;
+	if (length)
+		*length = resp.length;
+	return resp.ret;
+}
+
+static void fill_request(struct fsd_request *req, enum fsd_op op, int fd)
+{
+	memset(req, 0, sizeof(*req));
+	req->magic = FSD_MAGIC;
+	req->tag = next_tag++;
+	req->op = op;
+	req->fd = fd;
+}
+
+/*
+ * One request, with @payload, and its response, with up to @max bytes of
+ * payload going to @buf
+ */
+static int call_length(struct fsd_request *req, const void *payload,
+		       uint32_t length, void *buf, size_t max,
+		       uint32_t *received)
+{
+	struct iovec iov[2] = {
+		{ req, sizeof(*req) },
+		{ (void *)payload, length },
+	};
+
+	if (sock < 0)
+		return -1;
+	req->length = length;
+	if (send_all(iov, length ? 2 : 1, -1))
+		return -1;
+	return receive(buf, max, received);
+}
+
+/* One request, with @payload, and its response, with none expected */
+static int call(struct fsd_request *req, const void *payload, uint32_t length)
+{
+	return call_length(req, payload, length, NULL, 0, NULL);
+}
+
+static int call_simple(enum fsd_op op, int fd, uint64_t offset)
+{
+	struct fsd_request req;
+	int ret;
+
+	pthread_mutex_lock(&client_lock);
+	fill_request(&req, op, fd);
+	req.offset = offset;
+	ret = call(&req, NULL, 0);
+	pthread_mutex_unlock(&client_lock);
+	return ret;
+}
+
+static int call_names(enum fsd_op op, const char *a, const char *b)
+{
+	char names[2 * FS_FILENAME_LEN];
+	struct fsd_request req;
+	size_t la, lb;
+	int ret;
+
+	if (!a || (op == FSD_CLONE && !b))
+		return -1;
+	la = strnlen(a, FS_FILENAME_LEN);
+	lb = b ? strnlen(b, FS_FILENAME_LEN) : 0;
+	if (la == FS_FILENAME_LEN || lb == FS_FILENAME_LEN)
+		return -1;
+	memcpy(names, a, la + 1);
+	if (b)
+		memcpy(names + la + 1, b, lb + 1);
+
+	pthread_mutex_lock(&client_lock);
+	fill_request(&req, op, -1);
+	ret = call(&req, names, la + 1 + (b ? lb + 1 : 0));
+	if (op == FSD_OPEN && ret >= 0)
+		open_count++;
+	pthread_mutex_unlock(&client_lock);
+	return ret;
+}
+
+/* A call whose output the server captured, printed here */
+static int call_print(enum fsd_op op)
+{
+	struct fsd_request req;
+	struct fsd_response resp;
+	char *text = NULL;
+	int ret = -1;
+
+	pthread_mutex_lock(&client_lock);
+	fill_request(&req, op, -1);
+	if (sock >= 0 &&
+	    !send_all(&(struct iovec){ &req, sizeof(req) }, 1, -1) &&
+	    !recv_all(&resp, sizeof(resp)) &&
+	    (text = malloc(resp.length + 1)) &&
+	    !recv_all(text, resp.length)) {
+		fwrite(text, 1, resp.length, stdout);
+		ret = resp.ret;
+	}
+	free(text);
+	pthread_mutex_unlock(&client_lock);
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path = getenv("FSD_SOCKET");
+	char image[PATH_MAX];
+	struct fsd_request req;
+	struct iovec iov[2];
+	int memfd = -1, ret = -1;
+
+	if (!path)
+		path = FSD_SOCKET_DEFAULT;
+	if (!diskname || !realpath(diskname, image) ||
+	    strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+
+	pthread_mutex_lock(&client_lock);
+	if (sock >= 0)
+		goto out;
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		goto out;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		goto fail;
+
+	/* without shared memory, all data goes through the socket */
+	memfd = memfd_create("fsd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd >= 0 && !ftruncate(memfd, CLIENT_SHARED_SIZE) &&
+	    !fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK)) {
+		shared = mmap(NULL, CLIENT_SHARED_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, memfd, 0);
+		if (shared == MAP_FAILED)
+			shared = NULL;
+	}
+	shared_size = shared ? CLIENT_SHARED_SIZE : 0;
+
+	fill_request(&req, FSD_HELLO, -1);
+	req.count = shared_size;
+	req.length = strlen(image) + 1;
+	iov[0] = (struct iovec){ &req, sizeof(req) };
+	iov[1] = (struct iovec){ image, req.length };
+	if (send_all(iov, 2, shared ? memfd : -1) ||
+	    receive(NULL, 0, NULL) != 0)
+		goto fail;
+	ret = 0;
+	goto out;
+
+fail:
+	if (shared)
+		munmap(shared, shared_size);
+	shared = NULL;
+	shared_size = 0;
+	close(sock);
+	sock = -1;
+out:
+	if (memfd >= 0)
+		close(memfd);
+	pthread_mutex_unlock(&client_lock);
+	return ret;
+}
+
+int fs_umount(void)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&client_lock);
+	if (sock >= 0 && open_count == 0) {
+		while (mappings) {
+			struct mapping *next = mappings->next;
+
+			free(mappings);
+			mappings = next;
+		}
+		if (shared)
+			munmap(shared, shared_size);
+		shared = NULL;
+		shared_size = 0;
+		ret = close(sock);
+		sock = -1;
+	}
+	pthread_mutex_unlock(&client_lock);
+	return ret;
+}
+
+int fs_info(void)
+{
+	return call_print(FSD_INFO);
+}
+
+int fs_ls(void)
+{
+	return call_print(FSD_LS);
+}
+
+int fs_check(void)
+{
+	return call_print(FSD_CHECK);
+}
+
+int fs_create(const char *filename)
+{
+	return call_names(FSD_CREATE, filename, NULL);
+}
+
+int fs_delete(const char *filename)
+{
+	return call_names(FSD_DELETE, filename, NULL);
+}
+
+int fs_clone(const char *src_filename, const char *dst_filename)
+{
+	return call_names(FSD_CLONE, src_filename, dst_filename);
+}
+
+int fs_readdir(size_t *cursor, struct fs_dirent *entries, size_t count)
+{
+	size_t max = (FSD_PAYLOAD_MAX - sizeof(uint64_t)) / sizeof(*entries);
+	struct fsd_request req;
+	uint64_t next;
+	char *payload;
+	uint32_t length;
+	int ret;
+
+	if (!cursor || !entries)
+		return -1;
+	if (count > max)
+		count = max;
+	payload = malloc(sizeof(next) + count * sizeof(*entries));
+	if (!payload)
+		return -1;
+
+	pthread_mutex_lock(&client_lock);
+	fill_request(&req, FSD_READDIR, -1);
+	req.offset = *cursor;
+	req.count = count;
+	ret = call_length(&req, NULL, 0, payload,
+			  sizeof(next) + count * sizeof(*entries), &length);
+	pthread_mutex_unlock(&client_lock);
+
+	if (ret >= 0 && length == sizeof(next) + ret * sizeof(*entries)) {
+		memcpy(&next, payload, sizeof(next));
+		memcpy(entries, payload + sizeof(next), ret * sizeof(*entries));
+		*cursor = next;
+	} else {
+		ret = -1;
+	}
+	free(payload);
+	return ret;
+}
+
+/* Names looked up per request */
+#define CLIENT_STAT_NAMES 4096
+
+int fs_stat_names(const char **filenames, struct fs_dirent *entries,
+		  size_t count)
+{
+	char *names = malloc(CLIENT_STAT_NAMES * FS_FILENAME_LEN);
+	struct fsd_request req;
+	size_t done, batch, i, len, at;
+	uint32_t length;
+	int ret = 0, found = 0;
+
+	if (!filenames || !entries || !names) {
+		free(names);
+		return -1;
+	}
+
+	/* names that cannot exist go as empty names, never found */
+	pthread_mutex_lock(&client_lock);
+	for (done = 0; done < count && ret >= 0; done += batch) {
+		batch = count - done;
+		if (batch > CLIENT_STAT_NAMES)
+			batch = CLIENT_STAT_NAMES;
+		for (i = 0, at = 0; i < batch; i++) {
+			const char *name = filenames[done + i];
+
+			len = name ? strnlen(name, FS_FILENAME_LEN) : 0;
+			if (len == FS_FILENAME_LEN)
+				len = 0;
+			if (len)
+				memcpy(names + at, name, len);
+			names[at + len] = '\0';
+			at += len + 1;
+		}
+
+		fill_request(&req, FSD_STAT_NAMES, -1);
+		req.count = batch;
+		ret = call_length(&req, names, at, entries + done,
+				  batch * sizeof(*entries), &length);
+		if (ret >= 0 && length != batch * sizeof(*entries))
+			ret = -1;
+		if (ret > 0)
+			found += ret;
+	}
+	pthread_mutex_unlock(&client_lock);
+	free(names);
+	return ret < 0 ? -1 : found;
+}
+
+int fs_open(const char *filename)
+{
+	return call_names(FSD_OPEN, filename, NULL);
+}
+
+int fs_close(int fd)
+{
+	int ret = call_simple(FSD_CLOSE, fd, 0);
+
+	if (!ret) {
+		pthread_mutex_lock(&client_lock);
+		open_count--;
+		pthread_mutex_unlock(&client_lock);
+	}
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	return call_simple(FSD_STAT, fd, 0);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return call_simple(FSD_LSEEK, fd, offset);
+}
+
+int fs_truncate(int fd, size_t size)
+{
+	return call_simple(FSD_TRUNCATE, fd, size);
+}
+
+int fs_fallocate(int fd, size_t size)
+{
+	return call_simple(FSD_FALLOCATE, fd, size);
+}
+
+int fs_sync(void)
+{
+	return call_simple(FSD_SYNC, -1, 0);
+}
+
+/*
+ * Write or append one piece at a time: a short write ends the whole write.
+ * Appends larger than a piece are thus only atomic piece by piece.
+ */
+static int call_write(enum fsd_op op, int fd, void *buf, size_t count)
+{
+	size_t piece_max = shared ? shared_size : FSD_PAYLOAD_MAX;
+	struct fsd_request req;
+	size_t done = 0, piece;
+	int ret = 0;
+
+	if (!buf)
+		return -1;
+
+	pthread_mutex_lock(&client_lock);
+	do {
+		piece = count - done < piece_max ? count - done : piece_max;
+		fill_request(&req, op, fd);
+		req.count = piece;
+		if (shared && piece > FSD_INLINE_MAX) {
+			memcpy(shared, (char *)buf + done, piece);
+			req.flags = FSD_SHARED;
+			ret = call(&req, NULL, 0);
+		} else {
+			ret = call(&req, (char *)buf + done, piece);
+		}
+		if (ret > 0)
+			done += ret;
+	} while (ret == (int)piece && done < count);
+	pthread_mutex_unlock(&client_lock);
+	return done || ret >= 0 ? (int)done : -1;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	return call_write(FSD_WRITE, fd, buf, count);
+}
+
+int fs_append(int fd, void *buf, size_t count)
+{
+	return call_write(FSD_APPEND, fd, buf, count);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	size_t batch_max = shared ? shared_size : FSD_PAYLOAD_MAX;
+	struct fsd_request req[CLIENT_PIPELINE];
+	struct iovec iov[CLIENT_PIPELINE];
+	size_t done = 0, batch, piece, sent;
+	uint32_t length;
+	int n, i, ret = 0, short_read = 0;
+
+	if (!buf)
+		return -1;
+
+	pthread_mutex_lock(&client_lock);
+	while (sock >= 0 && done < count && !short_read) {
+		/*
+		 * Request up to CLIENT_PIPELINE pieces at once; the server runs
+		 * them in order, so once one comes back short the following
+		 * ones are past the end of the file.
+		 */
+		batch = count - done < batch_max ? count - done : batch_max;
+		piece = (batch + CLIENT_PIPELINE - 1) / CLIENT_PIPELINE;
+		for (n = 0, sent = 0; sent < batch; n++, sent += piece) {
+			fill_request(&req[n], FSD_READ, fd);
+			req[n].count = batch - sent < piece ? batch - sent : piece;
+			if (shared && req[n].count > FSD_INLINE_MAX) {
+				req[n].flags = FSD_SHARED;
+				req[n].offset = sent;
+			}
+			iov[n] = (struct iovec){ &req[n], sizeof(req[n]) };
+		}
+		if (send_all(iov, n, -1)) {
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			ret = receive((char *)buf + done, req[i].count, &length);
+			if (ret < 0) {
+				short_read = 1;
+				continue;
+			}
+			if (req[i].flags & FSD_SHARED)
+				memcpy((char *)buf + done,
+				       shared + req[i].offset, ret);
+			if (!short_read)
+				done += ret;
+			if ((uint32_t)ret < req[i].count)
+				short_read = 1;
+		}
+	}
+	pthread_mutex_unlock(&client_lock);
+	return done || ret >= 0 ? (int)done : -1;
+}
+
+const void *fs_mmap(int fd, size_t offset, size_t len)
+{
+	struct mapping *m;
+	struct fsd_request req;
+	size_t done = 0, piece;
+	int ret = 0;
+
+	if (!len || !(m = malloc(sizeof(*m) + len)))
+		return NULL;
+
+	pthread_mutex_lock(&client_lock);
+	while (ret >= 0 && done < len) {
+		piece = len - done < FSD_PAYLOAD_MAX ? len - done :
+			FSD_PAYLOAD_MAX;
+		fill_request(&req, FSD_MMAP, fd);
+		req.count = piece;
+		req.offset = offset + done;
+		ret = call_length(&req, NULL, 0, m->data + done, piece, NULL);
+		done += piece;
+	}
+	if (ret >= 0) {
+		m->next = mappings;
+		mappings = m;
+	}
+	pthread_mutex_unlock(&client_lock);
+
+	if (ret < 0) {
+		free(m);
+		return NULL;
+	}
+	return m->data;
+}
+
+int fs_munmap(const void *addr)
+{
+	struct mapping **link, *m;
+	int ret = -1;
+
+	pthread_mutex_lock(&client_lock);
+	for (link = &mappings; *link; link = &(*link)->next) {
+		if ((*link)->data == addr) {
+			m = *link;
+			*link = m->next;
+			free(m);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&client_lock);
+	return ret;
+}
+
+int fs_latency_dump(void)
+{
+	/* latencies are recorded by the server */
+	return -1;
+}
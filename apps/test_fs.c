@@ -1,12 +1,15 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -34,36 +37,162 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
-{
-	struct thread_arg *t_arg = arg;
-	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+/*
+ * Script engine
+ *
+ * The script is parsed once into an array of commands, with the data of every
+ * WRITE, APPEND and READ command loaded up front, and then executed. On top of the
+ * file system commands, a body enclosed between "LOOP<tab>n" and "END" is run
+ * n times and a body enclosed between "SPAWN<tab>k" and "END" is run by k
+ * concurrent threads. Each spawned thread opens the file open at the SPAWN on
+ * a descriptor of its own, at offset 0, so that the SEEK and READ commands of
+ * one thread do not move the offset of another. Per-command latencies and the
+ * overall throughput are reported on stderr once the script completes, and a
+ * READ that does not get the expected data makes the script fail, as does a
+ * TRUNCATE or FALLOCATE followed by "FAILS" that succeeds.
+ */
+
+enum script_op {
+	SCRIPT_MOUNT,
+	SCRIPT_UMOUNT,
+	SCRIPT_CREATE,
+	SCRIPT_DELETE,
+	SCRIPT_OPEN,
+	SCRIPT_CLOSE,
+	SCRIPT_SEEK,
+	SCRIPT_WRITE,
+	SCRIPT_APPEND,
+	SCRIPT_READ,
+	SCRIPT_TRUNCATE,
+	SCRIPT_FALLOCATE,
+	SCRIPT_SYNC,
+	SCRIPT_LOOP,
+	SCRIPT_SPAWN,
+	SCRIPT_END,
+	SCRIPT_OP_COUNT
+};
 
-	char line_buffer[1024];
-	int command_index = 1;
+static const char *script_op_names[SCRIPT_OP_COUNT] = {
+	[SCRIPT_MOUNT] = "MOUNT",
+	[SCRIPT_UMOUNT] = "UMOUNT",
+	[SCRIPT_CREATE] = "CREATE",
+	[SCRIPT_DELETE] = "DELETE",
+	[SCRIPT_OPEN] = "OPEN",
+	[SCRIPT_CLOSE] = "CLOSE",
+	[SCRIPT_SEEK] = "SEEK",
+	[SCRIPT_WRITE] = "WRITE",
+	[SCRIPT_APPEND] = "APPEND",
+	[SCRIPT_READ] = "READ",
+	[SCRIPT_TRUNCATE] = "TRUNCATE",
+	[SCRIPT_FALLOCATE] = "FALLOCATE",
+	[SCRIPT_SYNC] = "SYNC",
+	[SCRIPT_LOOP] = "LOOP",
+	[SCRIPT_SPAWN] = "SPAWN",
+	[SCRIPT_END] = "END",
+};
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+struct script_cmd {
+	enum script_op op;
+	/* File name for CREATE, DELETE and OPEN */
+	char *filename;
+	/* Offset, read length, iteration or thread count */
+	long num;
+	/* Data to write, or expected data of a read */
+	char *data;
+	size_t data_size;
+	int data_mapped;
+	/* Index of the matching END for LOOP and SPAWN */
+	size_t end;
+	/* TRUNCATE or FALLOCATE followed by FAILS, which must not succeed */
+	int must_fail;
+};
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+struct script {
+	char *diskname;
+	struct script_cmd *cmds;
+	size_t count;
+	/* Largest READ length, to size per-thread read buffers */
+	long max_read;
+	int mounted;
+	/* Set by any READ that got unexpected data, or FAILS command that
+	 * succeeded */
+	int failed;
+	/* Per-command statistics, updated atomically by all threads */
+	uint64_t op_count[SCRIPT_OP_COUNT];
+	uint64_t op_ns[SCRIPT_OP_COUNT];
+	uint64_t op_max_ns[SCRIPT_OP_COUNT];
+};
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
-	if (!fd_script)
-		die_perror("fopen");
+struct script_ctx {
+	struct script *script;
+	int fs_fd;
+	/* Name of the file open on fs_fd */
+	const char *filename;
+	/* Only commands outside of LOOP and SPAWN bodies report their result */
+	int verbose;
+	char *read_buf;
+};
 
-	int fs_fd = -1;
+struct script_spawn {
+	pthread_t thread;
+	struct script_ctx ctx;
+	/* Descriptor opened for the thread, or -1 */
+	int own_fd;
+	size_t begin, end;
+};
+
+static uint64_t script_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void script_load_file(struct script_cmd *cmd, const char *path, int map)
+{
+	struct stat st;
+	int data_fd;
+
+	data_fd = open(path, O_RDONLY);
+	if (data_fd < 0)
+		die_perror("open");
+	if (fstat(data_fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", path);
+
+	cmd->data_size = st.st_size;
+	if (map && st.st_size) {
+		cmd->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				 data_fd, 0);
+		if (cmd->data == MAP_FAILED)
+			die_perror("mmap");
+		cmd->data_mapped = 1;
+	} else {
+		cmd->data = calloc(st.st_size + 1, sizeof(char));
+		if (!cmd->data)
+			die_perror("calloc");
+		size_t n = read(data_fd, cmd->data, st.st_size);
+		assert(n == (size_t)st.st_size);
+	}
+	close(data_fd);
+}
+
+static void script_parse(struct script *sc, FILE *fd_script)
+{
+	const int total_command_parts = 4;
+	char *command_args[total_command_parts];
+	char line_buffer[1024];
+	int command_index;
+	size_t capacity = 0, depth = 0;
+	size_t *open_blocks = NULL;
 
-	/* Loop through the script and execute the specified commands */
 	while (fgets(line_buffer, 1024, fd_script) != NULL) {
+		struct script_cmd *cmd;
+		char *command;
+		size_t i;
+
 		/* Remove trailing newline from command line */
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
@@ -74,199 +203,439 @@ void thread_fs_script(void *arg)
 		command_index = 1;
 		do {
 			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
+		} while (command_args[command_index++] != NULL && command_index < total_command_parts);
 		command = command_args[0];
 
-		int data_fd;
-		int count, data_size;
-
-		char *read_buf;
-
 		/* End when no command present */
 		if (!command)
 			break;
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
-				printf("MOUNT successful.\n");
-				mounted = 1;
+		if (sc->count == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			sc->cmds = realloc(sc->cmds, capacity * sizeof(*sc->cmds));
+			open_blocks = realloc(open_blocks,
+					      capacity * sizeof(*open_blocks));
+			if (!sc->cmds || !open_blocks)
+				die_perror("realloc");
+		}
+		cmd = &sc->cmds[sc->count];
+		memset(cmd, 0, sizeof(*cmd));
+
+		for (i = 0; i < SCRIPT_OP_COUNT; i++)
+			if (!strcmp(command, script_op_names[i]))
+				break;
+		if (i == SCRIPT_OP_COUNT) {
+			/* Unknown commands are ignored */
+			continue;
+		}
+		cmd->op = i;
+
+		switch (cmd->op) {
+		case SCRIPT_CREATE:
+		case SCRIPT_DELETE:
+		case SCRIPT_OPEN:
+			if (!command_args[1])
+				die("%s needs a file name", command);
+			cmd->filename = strdup(command_args[1]);
+			break;
+
+		case SCRIPT_SEEK:
+		case SCRIPT_TRUNCATE:
+		case SCRIPT_FALLOCATE:
+		case SCRIPT_LOOP:
+		case SCRIPT_SPAWN:
+			if (!command_args[1])
+				die("%s needs a number", command);
+			cmd->num = atol(command_args[1]);
+			cmd->must_fail = command_args[2] &&
+					 strcmp(command_args[2], "FAILS") == 0;
+			if (cmd->op == SCRIPT_SPAWN && cmd->num < 1)
+				die("invalid thread count");
+			if (cmd->op == SCRIPT_LOOP || cmd->op == SCRIPT_SPAWN)
+				open_blocks[depth++] = sc->count;
+			break;
+
+		case SCRIPT_END:
+			if (!depth)
+				die("END without LOOP or SPAWN");
+			sc->cmds[open_blocks[--depth]].end = sc->count;
+			break;
+
+		case SCRIPT_WRITE:
+		case SCRIPT_APPEND:
+			if (!command_args[1] || !command_args[2])
+				die("%s needs a data source", command);
+			if (strcmp(command_args[1], "DATA") == 0) {
+				cmd->data = strdup(command_args[2]);
+				cmd->data_size = strlen(cmd->data);
+			} else if (strcmp(command_args[1], "FILE") == 0) {
+				script_load_file(cmd, command_args[2], 1);
+			} else {
+				die_perror("Could not find data to write");
 			}
+			break;
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
-				printf("UMOUNT successful.\n");
-				mounted = 0;
+		case SCRIPT_READ:
+			if (!command_args[1] || !command_args[2] || !command_args[3])
+				die("Invalid data description");
+			cmd->num = atol(command_args[1]);
+			if (cmd->num < 0)
+				die("invalid data read length");
+			if (cmd->num > sc->max_read)
+				sc->max_read = cmd->num;
+			if (strcmp(command_args[2], "DATA") == 0) {
+				cmd->data = strdup(command_args[3]);
+				cmd->data_size = strlen(cmd->data);
+			} else if (strcmp(command_args[2], "FILE") == 0) {
+				script_load_file(cmd, command_args[3], 0);
+			} else {
+				die("Invalid data description");
 			}
+			break;
 
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+		default:
+			break;
+		}
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+		sc->count++;
+	}
 
-			printf("CREATE successful.\n");
+	if (depth)
+		die("LOOP or SPAWN without END");
+	free(open_blocks);
+}
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+static void script_free(struct script *sc)
+{
+	size_t i;
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+	for (i = 0; i < sc->count; i++) {
+		struct script_cmd *cmd = &sc->cmds[i];
 
+		free(cmd->filename);
+		if (cmd->data_mapped)
+			munmap(cmd->data, cmd->data_size);
+		else
+			free(cmd->data);
+	}
+	free(sc->cmds);
+}
+
+static void script_exec(struct script_ctx *ctx, struct script_cmd *cmd)
+{
+	struct script *sc = ctx->script;
+	size_t diff;
+	int count;
+
+	switch (cmd->op) {
+	case SCRIPT_MOUNT:
+		if (fs_mount(sc->diskname))
+			die("Cannot mount disk");
+		if (ctx->verbose)
+			printf("MOUNT successful.\n");
+		sc->mounted = 1;
+		break;
+
+	case SCRIPT_UMOUNT:
+		if (sc->mounted && fs_umount())
+			die("Cannot unmount");
+		if (ctx->verbose)
+			printf("UMOUNT successful.\n");
+		sc->mounted = 0;
+		break;
+
+	case SCRIPT_CREATE:
+		if (fs_create(cmd->filename)) {
+			fs_umount();
+			die("Cannot create file");
+		}
+		if (ctx->verbose)
+			printf("CREATE successful.\n");
+		break;
+
+	case SCRIPT_DELETE:
+		if (fs_delete(cmd->filename)) {
+			fs_umount();
+			die("Cannot delete file");
+		}
+		if (ctx->verbose)
 			printf("DELETE successful.\n");
+		break;
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+	case SCRIPT_OPEN:
+		ctx->fs_fd = fs_open(cmd->filename);
+		if (ctx->fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+		ctx->filename = cmd->filename;
+		if (ctx->verbose)
+			printf("OPEN successful.\n");
+		break;
+
+	case SCRIPT_CLOSE:
+		if (fs_close(ctx->fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+		if (ctx->verbose)
+			printf("CLOSE successful.\n");
+		break;
+
+	case SCRIPT_SEEK:
+		if (fs_lseek(ctx->fs_fd, cmd->num)) {
+			fs_umount();
+			die("Cannot seek to position");
+		}
+		if (ctx->verbose)
+			printf("SEEK successful.\n");
+		break;
+
+	case SCRIPT_WRITE:
+		count = fs_write(ctx->fs_fd, cmd->data, cmd->data_size);
+		if (count < 0) {
+			fs_umount();
+			die("write error");
+		}
+		if (ctx->verbose)
+			printf("Wrote %d bytes to file.\n", count);
+		break;
 
-			fs_fd = fs_open(fs_filename);
+	case SCRIPT_APPEND:
+		count = fs_append(ctx->fs_fd, cmd->data, cmd->data_size);
+		if (count < 0) {
+			fs_umount();
+			die("append error");
+		}
+		if (ctx->verbose)
+			printf("Appended %d bytes to file.\n", count);
+		break;
+
+	case SCRIPT_READ:
+		count = fs_read(ctx->fs_fd, ctx->read_buf, cmd->num);
+		if (count < 0) {
+			fs_umount();
+			die("read error");
+		}
+		ctx->read_buf[count] = '\0';
+
+		if ((size_t)count == cmd->data_size &&
+		    memcmp(cmd->data, ctx->read_buf, count) == 0) {
+			if (ctx->verbose)
+				printf("Read %d bytes from file. Compared %zu correct.\n",
+				       count, cmd->data_size);
+		} else {
+			for (diff = 0; diff < (size_t)count &&
+			     diff < cmd->data_size &&
+			     ctx->read_buf[diff] == cmd->data[diff]; diff++)
+				;
+			printf("Read unexpected data! %d bytes read, %zu expected, "
+			       "first difference at byte %zu\n", count,
+			       cmd->data_size, diff);
+			__atomic_store_n(&sc->failed, 1, __ATOMIC_RELAXED);
+		}
+		break;
 
-			if (fs_fd < 0) {
+	case SCRIPT_TRUNCATE:
+		if (fs_truncate(ctx->fs_fd, cmd->num)) {
+			if (!cmd->must_fail) {
 				fs_umount();
-				die("Cannot open file");
+				die("Cannot truncate file");
 			}
+			if (ctx->verbose)
+				printf("TRUNCATE failed as expected.\n");
+		} else if (cmd->must_fail) {
+			printf("TRUNCATE succeeded unexpectedly!\n");
+			__atomic_store_n(&sc->failed, 1, __ATOMIC_RELAXED);
+		} else if (ctx->verbose) {
+			printf("TRUNCATE successful.\n");
+		}
+		break;
 
-			printf("OPEN successful.\n");
-
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
+	case SCRIPT_FALLOCATE:
+		if (fs_fallocate(ctx->fs_fd, cmd->num)) {
+			if (!cmd->must_fail) {
 				fs_umount();
-				die("Cannot close file");
+				die("Cannot allocate space for file");
 			}
+			if (ctx->verbose)
+				printf("FALLOCATE failed as expected.\n");
+		} else if (cmd->must_fail) {
+			printf("FALLOCATE succeeded unexpectedly!\n");
+			__atomic_store_n(&sc->failed, 1, __ATOMIC_RELAXED);
+		} else if (ctx->verbose) {
+			printf("FALLOCATE successful.\n");
+		}
+		break;
 
-			printf("CLOSE successful.\n");
+	case SCRIPT_SYNC:
+		if (fs_sync()) {
+			fs_umount();
+			die("Cannot sync file system");
+		}
+		if (ctx->verbose)
+			printf("SYNC successful.\n");
+		break;
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+	default:
+		break;
+	}
+}
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+static void script_run(struct script_ctx *ctx, size_t begin, size_t end);
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
+static void *script_spawn_thread(void *arg)
+{
+	struct script_spawn *spawn = arg;
+
+	script_run(&spawn->ctx, spawn->begin, spawn->end);
+	return NULL;
+}
+
+static void script_run(struct script_ctx *ctx, size_t begin, size_t end)
+{
+	struct script *sc = ctx->script;
+	size_t i;
+	long n;
+
+	for (i = begin; i < end; i++) {
+		struct script_cmd *cmd = &sc->cmds[i];
+
+		if (cmd->op == SCRIPT_LOOP) {
+			struct script_ctx body = *ctx;
+
+			body.verbose = 0;
+			for (n = 0; n < cmd->num; n++)
+				script_run(&body, i + 1, cmd->end);
+			ctx->fs_fd = body.fs_fd;
+			ctx->filename = body.filename;
+			i = cmd->end;
+
+		} else if (cmd->op == SCRIPT_SPAWN) {
+			struct script_spawn *spawns;
+
+			spawns = calloc(cmd->num, sizeof(*spawns));
+			if (!spawns)
+				die_perror("calloc");
+
+			/* Threads get their own descriptor on the open file */
+			for (n = 0; n < cmd->num; n++) {
+				spawns[n].ctx = *ctx;
+				spawns[n].ctx.verbose = 0;
+				spawns[n].own_fd = -1;
+				if (ctx->fs_fd >= 0) {
+					spawns[n].own_fd = fs_open(ctx->filename);
+					if (spawns[n].own_fd < 0) {
+						fs_umount();
+						die("Cannot open file");
+					}
+					spawns[n].ctx.fs_fd = spawns[n].own_fd;
 				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
+				spawns[n].ctx.read_buf = malloc(sc->max_read + 1);
+				spawns[n].begin = i + 1;
+				spawns[n].end = cmd->end;
+				if (!spawns[n].ctx.read_buf)
+					die_perror("malloc");
+				if (pthread_create(&spawns[n].thread, NULL,
+						   script_spawn_thread, &spawns[n]))
+					die("Cannot spawn thread");
 			}
-
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
+			for (n = 0; n < cmd->num; n++) {
+				pthread_join(spawns[n].thread, NULL);
+				free(spawns[n].ctx.read_buf);
+				/* unless the body closed it already */
+				if (spawns[n].own_fd >= 0 &&
+				    spawns[n].ctx.fs_fd == spawns[n].own_fd)
+					fs_close(spawns[n].own_fd);
 			}
+			free(spawns);
+			i = cmd->end;
+
+		} else {
+			uint64_t start = script_now();
+			uint64_t ns, max;
+
+			script_exec(ctx, cmd);
+
+			ns = script_now() - start;
+			__atomic_fetch_add(&sc->op_count[cmd->op], 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&sc->op_ns[cmd->op], ns, __ATOMIC_RELAXED);
+			max = __atomic_load_n(&sc->op_max_ns[cmd->op], __ATOMIC_RELAXED);
+			while (ns > max &&
+			       !__atomic_compare_exchange_n(&sc->op_max_ns[cmd->op],
+							    &max, ns, 1,
+							    __ATOMIC_RELAXED,
+							    __ATOMIC_RELAXED))
+				;
+		}
+	}
+}
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
-			}
-			printf("Wrote %d bytes to file.\n", count);
+static void script_report(struct script *sc, uint64_t elapsed)
+{
+	uint64_t total = 0;
+	size_t i;
 
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
+	fprintf(stderr, "Script timing:\n");
+	fprintf(stderr, "%-9s %9s %12s %10s %10s\n",
+		"command", "count", "total_ms", "avg_us", "max_us");
+	for (i = 0; i < SCRIPT_OP_COUNT; i++) {
+		if (!sc->op_count[i])
+			continue;
+		fprintf(stderr, "%-9s %9lu %12.3f %10.3f %10.3f\n",
+			script_op_names[i], sc->op_count[i], sc->op_ns[i] / 1e6,
+			sc->op_ns[i] / 1e3 / sc->op_count[i],
+			sc->op_max_ns[i] / 1e3);
+		total += sc->op_count[i];
+	}
+	fprintf(stderr, "Total: %lu ops in %.3f ms (%.0f ops/s)\n", total,
+		elapsed / 1e6, elapsed ? total * 1e9 / elapsed : 0.0);
+}
 
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
-				fs_umount();
-				die("Invalid data description");
-			}
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script sc = { 0 };
+	struct script_ctx ctx = { 0 };
+	FILE *fd_script;
+	uint64_t start;
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
 
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
-			}
+	sc.diskname = t_arg->argv[0];
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+	/* Open script on host computer */
+	fd_script = fopen(t_arg->argv[1], "r");
+	if (!fd_script)
+		die_perror("fopen");
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
-			}
+	script_parse(&sc, fd_script);
+	fclose(fd_script);
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+	ctx.script = &sc;
+	ctx.fs_fd = -1;
+	ctx.verbose = 1;
+	ctx.read_buf = malloc(sc.max_read + 1);
+	if (!ctx.read_buf)
+		die_perror("malloc");
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
-			}
-		}
-	}
+	/* Loop through the script and execute the specified commands */
+	start = script_now();
+	script_run(&ctx, 0, sc.count);
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (sc.mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	script_report(&sc, script_now() - start);
+
+	free(ctx.read_buf);
+	script_free(&sc);
+
+	if (sc.failed)
+		die("script got unexpected results");
 }
 
 void thread_fs_stat(void *arg)
@@ -398,6 +767,32 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <clone filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -480,6 +875,59 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+/* List every file with fs_readdir(), or the files named with fs_stat_names() */
+void thread_fs_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent entries[64];
+	size_t cursor = 0;
+	char *diskname;
+	int i, j, n;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>...]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc > 1) {
+		for (i = 1; i < t_arg->argc; i += n) {
+			n = t_arg->argc - i;
+			if (n > (int)ARRAY_SIZE(entries))
+				n = ARRAY_SIZE(entries);
+			if (fs_stat_names((const char **)&t_arg->argv[i],
+					  entries, n) < 0) {
+				fs_umount();
+				die("Cannot look up files");
+			}
+			for (j = 0; j < n; j++) {
+				if (entries[j].filename[0])
+					printf("%s %u %u\n", entries[j].filename,
+					       entries[j].size,
+					       entries[j].first_block);
+				else
+					printf("%s not found\n",
+					       t_arg->argv[i + j]);
+			}
+		}
+	} else {
+		while ((n = fs_readdir(&cursor, entries,
+				       ARRAY_SIZE(entries))) > 0)
+			for (i = 0; i < n; i++)
+				printf("%s %u %u\n", entries[i].filename,
+				       entries[i].size, entries[i].first_block);
+		if (n < 0) {
+			fs_umount();
+			die("Cannot list files");
+		}
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -499,6 +947,31 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_fsck(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int problems;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	problems = fs_check();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (problems < 0)
+		die("Cannot check file system");
+	if (problems > 0)
+		exit(1);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -507,15 +980,74 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+/* Print a range of a file, read in place with fs_mmap() */
+void thread_fs_mcat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	size_t offset = 0, len;
+	const char *data;
+	int fs_fd, stat;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename> [<offset> [<length>]]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+	if (t_arg->argc > 2)
+		offset = get_argv(t_arg->argv[2]);
+	len = t_arg->argc > 3 ? get_argv(t_arg->argv[3]) :
+		(size_t)stat - offset;
+
+	data = fs_mmap(fs_fd, offset, len);
+	if (!data) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot map file");
+	}
+
+	printf("Mapped file '%s' (%zu bytes at %zu)\n", filename, len, offset);
+	printf("Content of the file:\n");
+	fwrite(data, 1, len, stdout);
+	fflush(stdout);
+
+	if (fs_munmap(data) || fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
 	{ "info",	thread_fs_info },
+	{ "fsck",	thread_fs_fsck },
 	{ "ls",		thread_fs_ls },
+	{ "dir",	thread_fs_dir },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
 	{ "cat",	thread_fs_cat },
+	{ "mcat",	thread_fs_mcat },
 	{ "stat",	thread_fs_stat },
 	{ "script",	thread_fs_script }
 };
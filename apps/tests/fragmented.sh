@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# A file whose blocks are all apart takes one extent per block, so a transfer
+# of more blocks than a batch has extents must be split over several batches.
+# Two files are grown one block at a time in turns, then one of them is read
+# and rewritten whole in one call each.
+#
+# Usage: fragmented.sh [<directory of fs_make.x and test_fs.x>]
+
+set -e
+
+bin=$(cd "${1:-$(dirname "$0")/..}" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp"
+
+# 300 blocks for each file, every block different
+blocks=300
+seq 1 400000 | head -c $((blocks * 4096)) > a
+seq 400001 800000 | head -c $((blocks * 4096)) > b
+seq 800001 1200000 | head -c $((blocks * 4096)) > c
+mkdir parts
+split -b 4096 a parts/a.
+split -b 4096 b parts/b.
+
+{
+	echo "MOUNT"
+	echo "CREATE	a"
+	echo "CREATE	b"
+	for part in parts/a.*; do
+		echo "OPEN	a"
+		echo "APPEND	FILE	$part"
+		echo "CLOSE"
+		echo "OPEN	b"
+		echo "APPEND	FILE	parts/b.${part#parts/a.}"
+		echo "CLOSE"
+	done
+	echo "OPEN	a"
+	echo "READ	$((blocks * 4096))	FILE	a"
+	echo "SEEK	0"
+	echo "WRITE	FILE	c"
+	echo "SEEK	0"
+	echo "READ	$((blocks * 4096))	FILE	c"
+	echo "CLOSE"
+	echo "OPEN	b"
+	echo "READ	$((blocks * 4096))	FILE	b"
+	echo "CLOSE"
+	echo "UMOUNT"
+} > script
+
+for threads in "" 4; do
+	"$bin/fs_make.x" disk.fs $((blocks * 2 + 10)) > /dev/null
+	if ! FS_IO_THREADS=$threads "$bin/test_fs.x" script disk.fs script > log 2>&1; then
+		echo "fragmented: failed with FS_IO_THREADS='$threads'" >&2
+		cat log >&2
+		exit 1
+	fi
+done
+echo "fragmented: ok"
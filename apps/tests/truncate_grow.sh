@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Shrinking a file and growing it back must read zeros past the point it was
+# shrunk to, not what the file held there before. On compressed images, the
+# chunk straddling that point used to stay cached with its old content.
+# Growing a file on a full image must fail and leave the file as it was.
+#
+# Usage: truncate_grow.sh [<directory of fs_make.x and test_fs.x>]
+
+set -e
+
+bin=$(cd "${1:-$(dirname "$0")/..}" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp"
+
+# 40000 bytes, compressible so that chunks get stored compressed
+yes abcdefghijklmnop | head -c 40000 > data
+# what reading from 16384 on gives after truncating to 25384 then to 40000
+head -c 25384 data | tail -c +16385 > expected
+head -c 14616 /dev/zero >> expected
+
+cat > script <<END
+MOUNT
+CREATE	f
+OPEN	f
+WRITE	FILE	data
+TRUNCATE	25384
+TRUNCATE	40000
+SEEK	16384
+READ	23616	FILE	expected
+CLOSE
+UMOUNT
+END
+
+for features in "" compress sparse dedup clones compress,dedup; do
+	if [ -n "$features" ]; then
+		"$bin/fs_make.x" -f "$features" disk.fs 100 > /dev/null
+	else
+		"$bin/fs_make.x" disk.fs 100 > /dev/null
+	fi
+	if ! "$bin/test_fs.x" script disk.fs script > log 2>&1; then
+		echo "truncate_grow: failed with features '$features'" >&2
+		cat log >&2
+		exit 1
+	fi
+done
+# a file of 8 blocks and one taking the other 12 fill a 20-block image, and
+# the first one cannot grow to 15 blocks
+head -c 30000 data > small
+head -c 49152 /dev/zero > filler
+cat > full <<END
+MOUNT
+CREATE	f
+OPEN	f
+WRITE	FILE	small
+CLOSE
+CREATE	g
+OPEN	g
+WRITE	FILE	filler
+CLOSE
+OPEN	f
+TRUNCATE	60000	FAILS
+READ	60000	FILE	small
+CLOSE
+UMOUNT
+END
+
+for features in "" small; do
+	if [ -n "$features" ]; then
+		"$bin/fs_make.x" -f "$features" disk.fs 20 > /dev/null
+	else
+		"$bin/fs_make.x" disk.fs 20 > /dev/null
+	fi
+	if ! "$bin/test_fs.x" script disk.fs full > log 2>&1 ||
+	   ! "$bin/test_fs.x" fsck disk.fs > log 2>&1; then
+		echo "truncate_grow: failed with features '$features' on a full image" >&2
+		cat log >&2
+		exit 1
+	fi
+done
+echo "truncate_grow: ok"
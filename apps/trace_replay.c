@@ -0,0 +1,166 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <latency.h>
+#include <trace.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Records read from the trace file at once */
+#define REPLAY_BATCH 4096
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / 1000000000ull,
+		.tv_nsec = deadline % 1000000000ull,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-t] <trace file> <diskimage>\n", program);
+	fprintf(stderr, "\t-t\treplay with the recorded timing "
+		"(default: as fast as possible)\n");
+	fprintf(stderr, "Traced writes store zero-filled blocks: replay against "
+		"a scratch copy of the image.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_header header;
+	struct trace_record recs[REPLAY_BATCH];
+	uint64_t per_op[LAT_OP_COUNT + 1][2] = { { 0 } };
+	uint64_t count[2] = { 0 }, failed = 0, max_lag = 0;
+	uint64_t first_ts = 0, start;
+	int timed = 0, opt, have_first = 0;
+	char *buf;
+	FILE *trace;
+	size_t n, i;
+
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		if (opt == 't')
+			timed = 1;
+		else
+			usage(argv[0]);
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	trace = fopen(argv[optind], "rb");
+	if (!trace)
+		die_perror("fopen");
+	if (fread(&header, sizeof(header), 1, trace) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)))
+		die("not a block trace: %s", argv[optind]);
+
+	if (block_disk_open(argv[optind + 1]))
+		die("Cannot open diskimage");
+	if (header.block_size != BLOCK_SIZE &&
+	    block_disk_set_block_size(header.block_size))
+		die("trace block size %u does not fit the disk",
+		    header.block_size);
+
+	buf = calloc(1, header.block_size);
+	if (!buf)
+		die_perror("calloc");
+
+	start = now_ns();
+	while ((n = fread(recs, sizeof(recs[0]), ARRAY_SIZE(recs), trace)) > 0) {
+		for (i = 0; i < n; i++) {
+			struct trace_record *rec = &recs[i];
+			unsigned int op = rec->op < LAT_OP_COUNT ?
+				rec->op : LAT_OP_COUNT;
+			int ret;
+
+			if (!have_first) {
+				first_ts = rec->time_ns;
+				have_first = 1;
+			}
+
+			if (timed) {
+				uint64_t due = start + (rec->time_ns - first_ts);
+				uint64_t now = now_ns();
+
+				if (now < due)
+					sleep_until(due);
+				else if (now - due > max_lag)
+					max_lag = now - due;
+			}
+
+			if (rec->dir == TRACE_WRITE)
+				ret = block_write(rec->block, buf);
+			else
+				ret = block_read(rec->block, buf);
+			if (ret)
+				failed++;
+
+			count[rec->dir == TRACE_WRITE]++;
+			per_op[op][rec->dir == TRACE_WRITE]++;
+		}
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	block_disk_close();
+	fclose(trace);
+	free(buf);
+
+	printf("Replayed %" PRIu64 " reads, %" PRIu64 " writes (%" PRIu64
+	       " failed) in %.3f ms\n",
+	       count[0], count[1], failed, elapsed / 1e6);
+	if (elapsed)
+		printf("Throughput: %.0f ops/s\n",
+		       (count[0] + count[1]) * 1e9 / elapsed);
+	if (timed)
+		printf("Max lag behind schedule: %.3f ms\n", max_lag / 1e6);
+
+	printf("%-14s %10s %10s\n", "caller", "reads", "writes");
+	for (i = 0; i <= LAT_OP_COUNT; i++) {
+		const char *name = lat_op_name(i);
+
+		if (!per_op[i][0] && !per_op[i][1])
+			continue;
+		printf("%-14s %10" PRIu64 " %10" PRIu64 "\n", name ? name : "(none)",
+		       per_op[i][0], per_op[i][1]);
+	}
+
+	/* Block latencies are available when run with FS_LATENCY set */
+	fflush(stdout);
+	fs_latency_dump();
+
+	return 0;
+}
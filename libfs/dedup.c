@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+#define INITIAL_CAPACITY 1024
+
+// XXH64 constants
+#define PRIME1 0x9E3779B185EBCA87ull
+#define PRIME2 0xC2B2AE3D27D4EB4Full
+#define PRIME3 0x165667B19E3779F9ull
+#define PRIME4 0x85EBCA77C2B2AE63ull
+#define PRIME5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * PRIME2, 31) * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t lane)
+{
+	return (acc ^ round64(0, lane)) * PRIME1 + PRIME4;
+}
+
+// the XXH64 hash, with a seed of 0
+uint64_t dedup_fingerprint(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	uint64_t hash;
+	uint64_t word;
+
+	if (len >= 32)
+	{
+		// four independent lanes, so that the multiplications overlap
+		uint64_t lane[4] = {PRIME1 + PRIME2, PRIME2, 0, -PRIME1};
+		do
+		{
+			for (int i = 0; i < 4; i++, p += 8)
+			{
+				memcpy(&word, p, 8);
+				lane[i] = round64(lane[i], word);
+			}
+		} while (end - p >= 32);
+
+		hash = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+		for (int i = 0; i < 4; i++)
+		{
+			hash = merge64(hash, lane[i]);
+		}
+	}
+	else
+	{
+		hash = PRIME5;
+	}
+	hash += len;
+
+	for (; end - p >= 8; p += 8)
+	{
+		memcpy(&word, p, 8);
+		hash = rotl64(hash ^ round64(0, word), 27) * PRIME1 + PRIME4;
+	}
+	if (end - p >= 4)
+	{
+		uint32_t half;
+		memcpy(&half, p, 4);
+		hash = rotl64(hash ^ (half * PRIME1), 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++)
+	{
+		hash = rotl64(hash ^ (*p * PRIME5), 11) * PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= PRIME2;
+	hash ^= hash >> 29;
+	hash *= PRIME3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+int dedup_init(struct dedup_index *idx)
+{
+	idx->slots = calloc(INITIAL_CAPACITY, sizeof(*idx->slots));
+	idx->capacity = idx->slots != NULL ? INITIAL_CAPACITY : 0;
+	idx->count = 0;
+	return idx->slots != NULL ? 0 : -1;
+}
+
+// slot holding @fingerprint, or the empty slot where it would go
+static size_t find_slot(const struct dedup_index *idx, uint64_t fingerprint)
+{
+	size_t mask = idx->capacity - 1;
+	size_t i = fingerprint & mask;
+
+	while (idx->slots[i].block != 0 && idx->slots[i].fingerprint != fingerprint)
+	{
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+const struct dedup_entry *dedup_lookup(const struct dedup_index *idx, uint64_t fingerprint)
+{
+	if (idx->capacity == 0)
+	{
+		return NULL;
+	}
+
+	const struct dedup_entry *entry = &idx->slots[find_slot(idx, fingerprint)];
+	return entry->block != 0 ? entry : NULL;
+}
+
+static int grow(struct dedup_index *idx)
+{
+	struct dedup_index bigger = {
+		.slots = calloc(idx->capacity * 2, sizeof(*idx->slots)),
+		.capacity = idx->capacity * 2,
+		.count = idx->count,
+	};
+	if (bigger.slots == NULL)
+	{
+		return -1;
+	}
+
+	for (size_t i = 0; i < idx->capacity; i++)
+	{
+		if (idx->slots[i].block != 0)
+		{
+			bigger.slots[find_slot(&bigger, idx->slots[i].fingerprint)] = idx->slots[i];
+		}
+	}
+	free(idx->slots);
+	*idx = bigger;
+	return 0;
+}
+
+int dedup_insert(struct dedup_index *idx, const struct dedup_entry *entry)
+{
+	// keep the load factor at 3/4 at most
+	if ((idx->count + 1) * 4 > idx->capacity * 3 && grow(idx) < 0)
+	{
+		return -1;
+	}
+
+	struct dedup_entry *slot = &idx->slots[find_slot(idx, entry->fingerprint)];
+	if (slot->block == 0)
+	{
+		*slot = *entry;
+		idx->count++;
+	}
+	return 0;
+}
+
+void dedup_remove(struct dedup_index *idx, uint64_t fingerprint, uint32_t block)
+{
+	if (idx->capacity == 0)
+	{
+		return;
+	}
+
+	size_t mask = idx->capacity - 1;
+	size_t hole = find_slot(idx, fingerprint);
+	if (idx->slots[hole].block != block)
+	{
+		return;
+	}
+	idx->count--;
+
+	// linear probing without tombstones: shift back the entries that would
+	// no longer be reachable past the hole
+	for (size_t i = (hole + 1) & mask; idx->slots[i].block != 0; i = (i + 1) & mask)
+	{
+		size_t home = idx->slots[i].fingerprint & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			idx->slots[hole] = idx->slots[i];
+			hole = i;
+		}
+	}
+	idx->slots[hole].block = 0;
+}
+
+void dedup_destroy(struct dedup_index *idx)
+{
+	free(idx->slots);
+	memset(idx, 0, sizeof(*idx));
+}
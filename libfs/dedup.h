@@ -0,0 +1,86 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Deduplication index
+ *
+ * In-memory hash table from the fingerprint of a chunk of file content to
+ * the data block where a copy of it is stored, along with how it is stored so
+ * that a candidate can be checked before being shared. Only one location is
+ * kept per fingerprint.
+ */
+
+struct dedup_entry
+{
+	uint64_t fingerprint;
+	uint32_t block;	 // first block of the stored chunk, 0 for an empty slot
+	uint16_t length; // bytes stored
+	uint16_t flags;	 // how they are stored
+};
+
+struct dedup_index
+{
+	struct dedup_entry *slots;
+	size_t capacity; // power of two
+	size_t count;
+};
+
+/**
+ * dedup_fingerprint - Fingerprint a chunk of data
+ * @data: Data
+ * @len: Length of @data
+ *
+ * Return: 64-bit non-cryptographic hash of @data. Equal data gives equal
+ * fingerprints, the converse is only very likely.
+ */
+uint64_t dedup_fingerprint(const void *data, size_t len);
+
+/**
+ * dedup_init - Set up an empty index
+ * @idx: Index
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int dedup_init(struct dedup_index *idx);
+
+/**
+ * dedup_lookup - Find where a chunk with a given fingerprint is stored
+ * @idx: Index
+ * @fingerprint: Fingerprint
+ *
+ * Return: NULL if no chunk with @fingerprint is known, otherwise its entry,
+ * valid until the index is next modified.
+ */
+const struct dedup_entry *dedup_lookup(const struct dedup_index *idx, uint64_t fingerprint);
+
+/**
+ * dedup_insert - Record where a chunk is stored
+ * @idx: Index
+ * @entry: Fingerprint and location of the chunk
+ *
+ * Nothing changes if a chunk with the same fingerprint is already known.
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int dedup_insert(struct dedup_index *idx, const struct dedup_entry *entry);
+
+/**
+ * dedup_remove - Forget a stored chunk
+ * @idx: Index
+ * @fingerprint: Fingerprint of the chunk
+ * @block: First block of the chunk
+ *
+ * Nothing changes unless @fingerprint is recorded as stored at @block.
+ */
+void dedup_remove(struct dedup_index *idx, uint64_t fingerprint, uint32_t block);
+
+/**
+ * dedup_destroy - Release the memory held by an index
+ * @idx: Index
+ */
+void dedup_destroy(struct dedup_index *idx);
+
+#endif /* _DEDUP_H */
@@ -0,0 +1,229 @@
+#include <stdint.h>
+
+#include "fatscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FATSCAN_X86
+#endif
+
+// bytes compared by each call to a vector kernel
+#define STRIDE 64
+
+/*
+ * Vector kernels compare STRIDE bytes of entries at a time and return a mask
+ * with one bit per byte, set for the bytes of the entries that match, so that
+ * the loops below work the same at either entry width. NULL when the CPU has
+ * no vector unit to run them on, in which case only scalar loops are used.
+ */
+static uint64_t (*zero_mask)(const void *p, unsigned int width);
+static uint64_t (*range_mask)(const void *p, unsigned int width, uint32_t limit);
+
+static inline uint32_t entry_at(const void *entries, size_t i, unsigned int width)
+{
+	return width == 32 ? ((const uint32_t *)entries)[i] : ((const uint16_t *)entries)[i];
+}
+
+static inline int out_of_range(uint32_t value, unsigned int width, uint32_t limit)
+{
+	return value >= limit && value != (width == 32 ? UINT32_MAX : UINT16_MAX);
+}
+
+#ifdef FATSCAN_X86
+static inline __m128i sse2_zero(__m128i v, unsigned int width)
+{
+	__m128i zero = _mm_setzero_si128();
+	return width == 32 ? _mm_cmpeq_epi32(v, zero) : _mm_cmpeq_epi16(v, zero);
+}
+
+// unsigned comparisons as signed ones, both sides biased by half the range
+static inline __m128i sse2_range(__m128i v, unsigned int width, uint32_t limit)
+{
+	__m128i ones = _mm_set1_epi32(-1);
+	if (width == 32)
+	{
+		__m128i above = _mm_cmpgt_epi32(_mm_xor_si128(v, _mm_set1_epi32(INT32_MIN)),
+										_mm_set1_epi32((int32_t)((limit - 1) ^ 0x80000000u)));
+		return _mm_andnot_si128(_mm_cmpeq_epi32(v, ones), above);
+	}
+	__m128i above = _mm_cmpgt_epi16(_mm_xor_si128(v, _mm_set1_epi16(INT16_MIN)),
+									_mm_set1_epi16((int16_t)((limit - 1) ^ 0x8000)));
+	return _mm_andnot_si128(_mm_cmpeq_epi16(v, ones), above);
+}
+
+static uint64_t sse2_zero_mask(const void *p, unsigned int width)
+{
+	const __m128i *v = p;
+	uint64_t mask = 0;
+
+	for (int i = 0; i < STRIDE / 16; i++)
+	{
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(sse2_zero(_mm_loadu_si128(&v[i]), width)) << (i * 16);
+	}
+	return mask;
+}
+
+static uint64_t sse2_range_mask(const void *p, unsigned int width, uint32_t limit)
+{
+	const __m128i *v = p;
+	uint64_t mask = 0;
+
+	for (int i = 0; i < STRIDE / 16; i++)
+	{
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(sse2_range(_mm_loadu_si128(&v[i]), width, limit)) << (i * 16);
+	}
+	return mask;
+}
+
+__attribute__((target("avx2"))) static inline __m256i avx2_zero(__m256i v, unsigned int width)
+{
+	__m256i zero = _mm256_setzero_si256();
+	return width == 32 ? _mm256_cmpeq_epi32(v, zero) : _mm256_cmpeq_epi16(v, zero);
+}
+
+__attribute__((target("avx2"))) static inline __m256i avx2_range(__m256i v, unsigned int width, uint32_t limit)
+{
+	__m256i ones = _mm256_set1_epi32(-1);
+	if (width == 32)
+	{
+		__m256i above = _mm256_cmpgt_epi32(_mm256_xor_si256(v, _mm256_set1_epi32(INT32_MIN)),
+										   _mm256_set1_epi32((int32_t)((limit - 1) ^ 0x80000000u)));
+		return _mm256_andnot_si256(_mm256_cmpeq_epi32(v, ones), above);
+	}
+	__m256i above = _mm256_cmpgt_epi16(_mm256_xor_si256(v, _mm256_set1_epi16(INT16_MIN)),
+									   _mm256_set1_epi16((int16_t)((limit - 1) ^ 0x8000)));
+	return _mm256_andnot_si256(_mm256_cmpeq_epi16(v, ones), above);
+}
+
+__attribute__((target("avx2"))) static uint64_t avx2_zero_mask(const void *p, unsigned int width)
+{
+	const __m256i *v = p;
+	uint32_t low = _mm256_movemask_epi8(avx2_zero(_mm256_loadu_si256(&v[0]), width));
+	uint32_t high = _mm256_movemask_epi8(avx2_zero(_mm256_loadu_si256(&v[1]), width));
+	return (uint64_t)high << 32 | low;
+}
+
+__attribute__((target("avx2"))) static uint64_t avx2_range_mask(const void *p, unsigned int width, uint32_t limit)
+{
+	const __m256i *v = p;
+	uint32_t low = _mm256_movemask_epi8(avx2_range(_mm256_loadu_si256(&v[0]), width, limit));
+	uint32_t high = _mm256_movemask_epi8(avx2_range(_mm256_loadu_si256(&v[1]), width, limit));
+	return (uint64_t)high << 32 | low;
+}
+#endif
+
+__attribute__((constructor)) static void fatscan_init(void)
+{
+#ifdef FATSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		zero_mask = avx2_zero_mask;
+		range_mask = avx2_range_mask;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		zero_mask = sse2_zero_mask;
+		range_mask = sse2_range_mask;
+	}
+#endif
+}
+
+// entries covered by whole strides, which vector kernels can scan
+static inline size_t vector_entries(size_t count, unsigned int width)
+{
+	size_t per_stride = STRIDE * 8 / width;
+	return zero_mask != NULL ? count / per_stride * per_stride : 0;
+}
+
+size_t fatscan_count_zero(const void *entries, size_t count, unsigned int width)
+{
+	const char *bytes = entries;
+	size_t entry_bytes = width / 8;
+	size_t vectored = vector_entries(count, width);
+	size_t zeros = 0;
+
+	for (size_t offset = 0; offset < vectored * entry_bytes; offset += STRIDE)
+	{
+		zeros += __builtin_popcountll(zero_mask(bytes + offset, width));
+	}
+	zeros /= entry_bytes;
+
+	for (size_t i = vectored; i < count; i++)
+	{
+		zeros += entry_at(entries, i, width) == 0;
+	}
+	return zeros;
+}
+
+size_t fatscan_find_zero(const void *entries, size_t count, unsigned int width)
+{
+	const char *bytes = entries;
+	size_t entry_bytes = width / 8;
+	size_t vectored = vector_entries(count, width);
+
+	for (size_t offset = 0; offset < vectored * entry_bytes; offset += STRIDE)
+	{
+		uint64_t mask = zero_mask(bytes + offset, width);
+		if (mask != 0)
+		{
+			return (offset + __builtin_ctzll(mask)) / entry_bytes;
+		}
+	}
+
+	size_t i = vectored;
+	while (i < count && entry_at(entries, i, width) != 0)
+	{
+		i++;
+	}
+	return i;
+}
+
+size_t fatscan_find_nonzero(const void *entries, size_t count, unsigned int width)
+{
+	const char *bytes = entries;
+	size_t entry_bytes = width / 8;
+	size_t vectored = vector_entries(count, width);
+
+	for (size_t offset = 0; offset < vectored * entry_bytes; offset += STRIDE)
+	{
+		uint64_t mask = ~zero_mask(bytes + offset, width);
+		if (mask != 0)
+		{
+			return (offset + __builtin_ctzll(mask)) / entry_bytes;
+		}
+	}
+
+	size_t i = vectored;
+	while (i < count && entry_at(entries, i, width) == 0)
+	{
+		i++;
+	}
+	return i;
+}
+
+size_t fatscan_count_out_of_range(const void *entries, size_t count, unsigned int width, uint32_t limit)
+{
+	// every 16-bit value but end-of-chain fits below such a limit
+	if (width == 16 && limit > UINT16_MAX)
+	{
+		return 0;
+	}
+
+	const char *bytes = entries;
+	size_t entry_bytes = width / 8;
+	size_t vectored = vector_entries(count, width);
+	size_t found = 0;
+
+	for (size_t offset = 0; offset < vectored * entry_bytes; offset += STRIDE)
+	{
+		found += __builtin_popcountll(range_mask(bytes + offset, width, limit));
+	}
+	found /= entry_bytes;
+
+	for (size_t i = vectored; i < count; i++)
+	{
+		found += out_of_range(entry_at(entries, i, width), width, limit);
+	}
+	return found;
+}
@@ -0,0 +1,58 @@
+#ifndef _FATSCAN_H
+#define _FATSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * FAT scanning kernels
+ *
+ * Bulk scans over arrays of FAT entries, 16 or 32 bits wide. On x86 each scan
+ * has SSE2 and AVX2 versions comparing a whole vector of entries at once, the
+ * best one the CPU supports being picked when the library is loaded; other
+ * CPUs, and the ends of arrays too short for a vector, use scalar loops.
+ */
+
+/**
+ * fatscan_count_zero - Count free entries
+ * @entries: FAT entries
+ * @count: Number of entries
+ * @width: Bits per entry, 16 or 32
+ *
+ * Return: number of entries equal to 0.
+ */
+size_t fatscan_count_zero(const void *entries, size_t count, unsigned int width);
+
+/**
+ * fatscan_find_zero - Find the first free entry
+ * @entries: FAT entries
+ * @count: Number of entries
+ * @width: Bits per entry, 16 or 32
+ *
+ * Return: index of the first entry equal to 0, or @count if there is none.
+ */
+size_t fatscan_find_zero(const void *entries, size_t count, unsigned int width);
+
+/**
+ * fatscan_find_nonzero - Find the end of a run of free entries
+ * @entries: FAT entries
+ * @count: Number of entries
+ * @width: Bits per entry, 16 or 32
+ *
+ * Return: index of the first entry not equal to 0, or @count if there is none.
+ */
+size_t fatscan_find_nonzero(const void *entries, size_t count, unsigned int width);
+
+/**
+ * fatscan_count_out_of_range - Count links past the end of the FAT
+ * @entries: FAT entries
+ * @count: Number of entries
+ * @width: Bits per entry, 16 or 32
+ * @limit: Number of data blocks, at least 1
+ *
+ * Return: number of entries of @limit or more, other than the end-of-chain
+ * value (all ones).
+ */
+size_t fatscan_count_out_of_range(const void *entries, size_t count, unsigned int width, uint32_t limit);
+
+#endif /* _FATSCAN_H */
@@ -1,25 +1,88 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "dedup.h"
 #include "disk.h"
+#include "fatscan.h"
 #include "fs.h"
-
-#define FAT_EOC 0xFFFF
-#define FAT_SIZE 2048
+#include "iopool.h"
+#include "latency.h"
+#include "lz.h"
+#include "pager.h"
+#include "trace.h"
+#include "writeback.h"
+
+#define FS_SIGNATURE "ECS150FS"	  // original format, 16-bit FAT
+#define FS_SIGNATURE_EXT "ECS150FX" // extended format, FAT width in superblock
+
+// FAT_EOC is how the end of a chain is reported at either width; on disk it
+// is stored as all ones (0xFFFF in 16-bit FATs)
+#define FAT_EOC 0xFFFFFFFF
+#define FAT16_EOC 0xFFFF
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// longest metadata region (superblock, FAT, root directory) read at mount
+#define MOUNT_READ_MAX 64
+// FAT blocks kept in memory at most, unless FS_FAT_CACHE says otherwise
+#define FAT_CACHE_BLOCKS 1024
+
+// superblock feature flags ("ECS150FX" only)
+#define FEATURE_SMALL_FILES 0x1 // tiny files inline or packed, see ENTRY_*
+#define FEATURE_COMPRESSION 0x2 // new files are mapped and compressed, see ENTRY_MAPPED
+#define FEATURE_DEDUP 0x4		// new files are mapped and deduplicated
+#define FEATURE_SPARSE 0x8		// new files are mapped, so that holes take no blocks
+#define FEATURE_CLONES 0x10		// new files are mapped, and clones share their chunks
+#define FEATURE_MAPPED (FEATURE_COMPRESSION | FEATURE_DEDUP | FEATURE_SPARSE | FEATURE_CLONES)
+#define FEATURE_REFS (FEATURE_DEDUP | FEATURE_CLONES) // with a refcount table
+#define FEATURES_KNOWN (FEATURE_SMALL_FILES | FEATURE_MAPPED)
+
+// directory entry flags
+#define ENTRY_INLINE 0x1 // content stored in the entry itself
+#define ENTRY_PACKED 0x2 // content stored in fragments of a shared pack block
+#define ENTRY_MAPPED 0x4 // FAT chain holding a chunk map, see struct ChunkMap
+
+// pack blocks are split in fragments, the first one holding the block header
+#define PACK_FRAGMENT 64
+#define PACK_FRAGMENTS (BLOCK_SIZE / PACK_FRAGMENT)
+#define PACK_MAX (BLOCK_SIZE / 4) // largest packed file
+
+// mapped files are split in chunks, of CHUNK_BLOCKS blocks when compressed
+// and of a single block otherwise
+#define CHUNK_BLOCKS 4
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE) // largest chunk
+#define CHUNK_LZ 0x1						   // chunk flag: stored LZ compressed
+
+// references to a chunk beyond the first one, per data block
+#define REFS_SIZE (BLOCK_SIZE / 2)
+#define REFS_MAX UINT16_MAX
 
 struct Superblock
 {
-	char signature[8]; // Signature equal to "ECS150FS"
+	char signature[8]; // Signature equal to "ECS150FS" or "ECS150FX"
 	uint16_t total_blocks;
 	uint16_t root_index;
 	uint16_t data_start;
 	uint16_t data_blocks;
 	uint8_t fat_blocks;
-	uint8_t padding[4079];
+	// "ECS150FX" only: the fields above are unused, the ones below apply
+	uint8_t fat_width; // bits per FAT entry, 16 or 32
+	uint32_t total_blocks32;
+	uint32_t root_index32;
+	uint32_t data_start32;
+	uint32_t data_blocks32;
+	uint32_t fat_blocks32;
+	uint32_t dir_blocks32; // root directory length, 0 meaning 1 block
+	uint32_t features;	   // FEATURE_* flags
+	uint32_t ref_blocks32; // refcount table length, following the FAT
+	uint32_t block_size32; // bytes per block, 0 meaning BLOCK_SIZE
+	uint8_t padding[4042];
 } __attribute__((packed));
 
 struct RootDirectory
@@ -27,542 +90,3878 @@ struct RootDirectory
 	// 32 byte entry per file
 	char filename[16];
 	uint32_t size;
-	uint16_t first_block_data;
-	char padding[10];
+	union
+	{
+		struct
+		{
+			uint16_t first_block_data;
+			uint16_t first_block_high; // upper half of the first block on 32-bit FATs
+			uint8_t fragment;		   // ENTRY_PACKED: first fragment in the pack block
+			char padding[6];
+		} __attribute__((packed));
+		char inline_data[11]; // ENTRY_INLINE: the file content
+	};
+	uint8_t flags; // ENTRY_* flags, always 0 without FEATURE_SMALL_FILES
+} __attribute__((packed));
+
+#define INLINE_MAX sizeof(((struct RootDirectory *)0)->inline_data)
+
+// Header of a pack block, in its first fragment
+struct PackHeader
+{
+	uint64_t used; // bitmap of the fragments in use, bit 0 being this header
+	char padding[PACK_FRAGMENT - 8];
+} __attribute__((packed));
+
+// Directories longer than one block are hash tables with one bucket per
+// block. The first entry of each block is then this header rather than a file.
+struct DirBucket
+{
+	uint16_t used;	  // files stored in this block
+	uint8_t overflow; // set once a file hashing here was stored further on
+	char padding[29];
 } __attribute__((packed));
 
-struct FatBlock
+// Chunk map entry of a compressed file
+struct ChunkMap
 {
-	uint16_t entry[FAT_SIZE]; // Array of 16-bit entries
+	uint32_t block;		  // first block of the FAT chain holding the chunk, 0 if none
+	uint16_t length;	  // bytes stored, compressed or not
+	uint16_t flags;		  // CHUNK_* flags
+	uint64_t fingerprint; // of the uncompressed content, with FEATURE_DEDUP
 } __attribute__((packed));
 
+#define MAP_ENTRIES (BLOCK_SIZE / sizeof(struct ChunkMap))
+
+// Location of a directory entry
+struct DirSlot
+{
+	uint32_t block; // directory block
+	uint32_t index; // entry in the block
+};
+
+// Superblock fields of either format, widened to 32 bits at mount
+struct Geometry
+{
+	uint32_t total_blocks;
+	uint32_t root_index;
+	uint32_t data_start;
+	uint32_t data_blocks;
+	uint32_t fat_blocks;
+	uint32_t dir_blocks;
+	uint32_t ref_blocks;
+	uint32_t features;
+	unsigned int fat_width;
+	unsigned int chunk_blocks; // chunk length of mapped files
+	uint32_t block_size;
+	unsigned int block_shift; // log2 of block_size
+	unsigned int fat_shift;	  // log2 of the entries per FAT block
+	uint32_t dir_entries;	  // directory entries per directory block
+};
+
+// When written data is made durable
+enum durability
+{
+	DURABILITY_NONE, // never: left to the host
+	DURABILITY_SYNC, // by fs_sync() and fs_umount()
+	DURABILITY_OP,	 // by every call that changes the file system
+};
+
+// Open file, 16 bytes so that descriptors never straddle cache lines
 struct FileDescriptor
 {
-	char filename[FS_FILENAME_LEN];
-	int offset;
+	struct DirSlot slot; // entry of the file, which stays put while it is open
+	size_t offset;
+};
+
+// Copy of a file range handed out by fs_mmap()
+struct MmapBuffer
+{
+	struct MmapBuffer *next;
+	char data[];
 };
 
+// Block of a FAT chain, @index links after the first one
+struct ChainPosition
+{
+	uint32_t first_block;
+	uint32_t index;
+	uint32_t block;
+};
+
+// Where the chain of a file was last written, kept for each directory entry
+// so that appends to several files each resume from their own end
+struct ChainTail
+{
+	struct ChainPosition position;
+	uint32_t epoch;		 // chain_epoch when @position was taken
+	uint32_t data_block; // block whose content @data holds, or FAT_EOC
+	char *data;			 // only allocated while the file is open
+};
+
+// descriptor table entries allocated first, doubled whenever they run out
+#define FD_TABLE_INITIAL 64
+#define FD_WORDS (FS_OPEN_MAX_COUNT / 64)
+
 // global variables
 struct Superblock *superblock;
-struct RootDirectory root_directory[FS_FILE_MAX_COUNT]; // root directory array size 128
-struct FatBlock *fatblock;
-static struct FileDescriptor fileD[FS_OPEN_MAX_COUNT];
+static struct pager dir_pager; // root directory blocks, as arrays of struct RootDirectory
+static struct pager fat_pager; // FAT blocks, as arrays of uint16_t or uint32_t entries
+static struct pager ref_pager; // refcount table blocks, as arrays of REFS_SIZE uint16_t
+static struct Geometry geometry;
+// descriptor table, cache line aligned, of fd_capacity entries
+static struct FileDescriptor *fileD;
+static uint32_t fd_capacity;
+// bitmap of the descriptors in use, and bitmap of its words with none free
+static uint64_t fd_used[FD_WORDS];
+static uint64_t fd_full[(FD_WORDS + 63) / 64];
+static int numOpen = 0;
+// descriptors open on each directory entry, indexed by block * dir_entries + index
+static uint32_t *open_count;
+// where each directory entry was last written, indexed like open_count
+static struct ChainTail *chain_tails;
+// bumped whenever chain blocks are freed, which makes every ChainTail stale
+static uint32_t chain_epoch;
+// FAT index to start looking for a free entry from
+static uint32_t fat_hint = 1;
+// last block of any chain read or written, for sequential access
+static struct ChainPosition chain_hint = {FAT_EOC, 0, FAT_EOC};
+// last pack block used, kept in memory and written through
+static char *pack_buf;
+static uint32_t pack_cached = FAT_EOC;
+// pack block to look for free fragments in first
+static uint32_t pack_hint = FAT_EOC;
+// chunk map block in use, written back at the end of each fs_write()
+static struct ChunkMap *map_buf;
+static uint32_t map_cached = FAT_EOC;
+static int map_dirty;
+// last chunk accessed, uncompressed, identified by its first block
+static char *chunk_buf;
+static uint32_t chunk_cached = FAT_EOC;
+// bytes of chunk_buf holding the content of chunk_cached, the rest being stale
+static size_t chunk_cached_length;
+// compressed chunk
+static char *lz_buf;
+// stored chunk being compared with a deduplication candidate
+static char *verify_buf;
+// where the content of each stored chunk is, with FEATURE_DEDUP
+static struct dedup_index dedup;
+// what waits for stable storage, from FS_DURABILITY at mount
+static enum durability durability;
+// read-only mapping of the disk, made by the first fs_mmap()
+static const char *image;
+// ranges handed out by fs_mmap() that had to be copied, until fs_munmap()
+static struct MmapBuffer *mmap_buffers;
+
+/*
+ * FAT access. The FAT is paged in block by block through fat_pager, so only
+ * the parts of it that are used take memory. Single entries go through
+ * fat_get()/fat_set(); chain walks have one copy per entry width so that the
+ * inner loop never has to check the width, and scans for free entries hand
+ * whole FAT blocks to the vector kernels of fatscan.h. Both only go back to
+ * the pager when crossing into the next FAT block. FAT blocks hold a power of
+ * two of entries at any block size, so entries are located with a shift and a
+ * mask rather than a division.
+ */
+
+static inline uint32_t fat_page(uint32_t index)
+{
+	return index >> geometry.fat_shift;
+}
 
-int fs_mount(const char *diskname)
+static inline uint32_t fat_slot(uint32_t index)
 {
-	// Open the virtual disk file
-	if (block_disk_open(diskname) == -1)
-	{
-		return -1;
-	}
+	return index & ((UINT32_C(1) << geometry.fat_shift) - 1);
+}
 
-	// Allocate memory for superblock and root_directory
-	superblock = (struct Superblock *)malloc(sizeof(struct Superblock));
-	if (block_read(0, superblock) == -1)
+static inline uint32_t fat_get(uint32_t index)
+{
+	if (geometry.fat_width == 32)
 	{
-		return -1;
+		uint32_t *page = pager_get(&fat_pager, fat_page(index), 0);
+		return page != NULL ? page[fat_slot(index)] : FAT_EOC;
 	}
 
-	if (block_read(superblock->root_index, root_directory) < 0)
-	{
-		return -1;
-	}
+	uint16_t *page = pager_get(&fat_pager, fat_page(index), 0);
+	uint16_t entry = page != NULL ? page[fat_slot(index)] : FAT16_EOC;
+	return entry == FAT16_EOC ? FAT_EOC : entry;
+}
 
-	// Allocate memory for the FAT blocks
-	fatblock = (struct FatBlock *)malloc((superblock->fat_blocks) * BLOCK_SIZE); // multipying # of fat blocks for correct allocation
-	// Read each FAT block and start count at 1
-	for (int i = 1; i <= superblock->fat_blocks; i++)
+static inline int fat_set(uint32_t index, uint32_t value)
+{
+	if (geometry.fat_width == 32)
 	{
-		if (block_read(i, (char *)fatblock + BLOCK_SIZE * (i - 1)))
+		uint32_t *page = pager_get(&fat_pager, fat_page(index), 1);
+		if (page == NULL)
 		{
 			return -1;
 		}
+		page[fat_slot(index)] = value;
+		return 0;
 	}
 
+	uint16_t *page = pager_get(&fat_pager, fat_page(index), 1);
+	if (page == NULL)
+	{
+		return -1;
+	}
+	page[fat_slot(index)] = value;
 	return 0;
 }
 
-// whenever fs_umount() is called, all meta-information and file data must have been written out to disk.
-int fs_umount(void)
+// follow @hops links from @block, stopping early at the end of the chain
+static uint32_t fat16_walk(uint32_t block, size_t hops)
 {
+	const uint16_t *page = NULL;
+	uint32_t page_index = UINT32_MAX;
 
-	if (block_write(superblock->root_index, root_directory) < 0)
+	while (hops-- && block != FAT16_EOC)
 	{
-		return -1;
+		if (fat_page(block) != page_index)
+		{
+			page_index = fat_page(block);
+			if ((page = pager_get(&fat_pager, page_index, 0)) == NULL)
+			{
+				return FAT_EOC;
+			}
+		}
+		block = page[fat_slot(block)];
 	}
+	return block == FAT16_EOC ? FAT_EOC : block;
+}
 
-	for (int i = 1; i <= superblock->fat_blocks; i++)
+static uint32_t fat32_walk(uint32_t block, size_t hops)
+{
+	const uint32_t *page = NULL;
+	uint32_t page_index = UINT32_MAX;
+
+	while (hops-- && block != FAT_EOC)
 	{
-		if (block_write(i, (char *)fatblock + BLOCK_SIZE * (i - 1)))
+		if (fat_page(block) != page_index)
 		{
-			return -1;
+			page_index = fat_page(block);
+			if ((page = pager_get(&fat_pager, page_index, 0)) == NULL)
+			{
+				return FAT_EOC;
+			}
 		}
+		block = page[fat_slot(block)];
 	}
+	return block;
+}
 
-	if (block_disk_close() == -1)
+static uint32_t fat_walk(uint32_t block, size_t hops)
+{
+	if (block == FAT_EOC)
 	{
-		return -1;
+		return FAT_EOC;
 	}
+	return geometry.fat_width == 32 ? fat32_walk(block, hops) : fat16_walk(block, hops);
+}
 
-	free(superblock);
-	return 0;
+static inline uint32_t fat_block_entries(void)
+{
+	return UINT32_C(1) << geometry.fat_shift;
 }
 
-int fs_info(void)
+// data blocks needed to hold @size bytes
+static inline size_t size_blocks(size_t size)
 {
-	if (block_disk_count() == -1)
-	{
-		return -1;
-	}
+	return (size + geometry.block_size - 1) >> geometry.block_shift;
+}
 
-	// count number of empty root directories
-	int Num_empty_entries = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+// first free entry in [from, data_blocks), or FAT_EOC
+static uint32_t fat_find_free(uint32_t from)
+{
+	uint32_t per_block = fat_block_entries();
+
+	for (uint32_t i = from; i < geometry.data_blocks;)
 	{
-		if (strcmp(root_directory[i].filename, "") == 0)
+		const char *page = pager_get(&fat_pager, i / per_block, 0);
+		if (page == NULL)
 		{
-			Num_empty_entries++;
+			break;
+		}
+
+		uint32_t end = MIN((i / per_block + 1) * per_block, geometry.data_blocks);
+		size_t found = fatscan_find_zero(page + i % per_block * (geometry.fat_width / 8), end - i, geometry.fat_width);
+		if (found < end - i)
+		{
+			return i + found;
 		}
+		i = end;
 	}
+	return FAT_EOC;
+}
+
+// number of free entries from @from on, counting @count of them at most
+static uint32_t fat_free_run(uint32_t from, uint32_t count)
+{
+	uint32_t per_block = fat_block_entries();
+	uint32_t last = MIN(from + count, geometry.data_blocks);
 
-	int fat_free_numerator = 0;
-	for (int i = 0; i < superblock->data_blocks; i++)
+	for (uint32_t i = from; i < last;)
 	{
+		const char *page = pager_get(&fat_pager, i / per_block, 0);
+		if (page == NULL)
+		{
+			return i - from;
+		}
 
-		if (fatblock->entry[i] == 0) // find an fat entry that is free
+		uint32_t end = MIN((i / per_block + 1) * per_block, last);
+		size_t run = fatscan_find_nonzero(page + i % per_block * (geometry.fat_width / 8), end - i, geometry.fat_width);
+		if (run < end - i)
 		{
-			fat_free_numerator++;
+			return i + run - from;
 		}
+		i = end;
 	}
+	return last - from;
+}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", block_disk_count());
-	printf("fat_blk_count=%d\n", superblock->fat_blocks);
-	printf("rdir_blk=%d\n", superblock->root_index);
-	printf("data_blk=%d\n", superblock->data_start);
-	printf("data_blk_count=%d\n", superblock->data_blocks);
-	printf("fat_free_ratio=%d/%d\n", fat_free_numerator, superblock->data_blocks);
-	printf("rdir_free_ratio=%d/%d\n", Num_empty_entries, FS_FILE_MAX_COUNT);
+static uint32_t fat_count_free(void)
+{
+	uint32_t per_block = fat_block_entries();
+	uint32_t count = 0;
 
-	return 0;
+	for (uint32_t i = 0; i < geometry.data_blocks; i += per_block)
+	{
+		const char *page = pager_get(&fat_pager, i / per_block, 0);
+		if (page == NULL)
+		{
+			break;
+		}
+		count += fatscan_count_zero(page, MIN(per_block, geometry.data_blocks - i), geometry.fat_width);
+	}
+	return count;
 }
 
-int get_file_size(const char *filename)
+// take a free data block out of the FAT as a one-block chain, or FAT_EOC when
+// the disk is full
+static uint32_t fat_alloc(void)
 {
-	// Open the file
-	FILE *file = fopen(filename, "rb");
-	if (file == NULL)
+	// entry 0 is reserved, so a wrapped-around search restarts from 1
+	uint32_t block = fat_find_free(fat_hint);
+	if (block == FAT_EOC && fat_hint > 1)
 	{
-		return -1;
+		block = fat_find_free(1);
 	}
-
-	// Move the file pointer to the end of the file
-	if (fseek(file, 0, SEEK_END) != 0)
+	if (block == FAT_EOC)
 	{
-		fclose(file);
-		return -1;
+		return FAT_EOC;
 	}
 
-	long file_size = ftell(file);
-	if (file_size == -1L)
+	if (fat_set(block, FAT_EOC) < 0)
 	{
-		fclose(file);
-		return -1;
+		return FAT_EOC;
 	}
-
-	fclose(file);
-	return file_size;
+	fat_hint = block + 1;
+	return block;
 }
 
-void fill_fat_entries(struct FatBlock *fatblock, uint16_t start_index, uint16_t end_index)
+static inline uint32_t file_first_block(const struct RootDirectory *file)
 {
-	uint16_t current_index = start_index;
-
-	while (current_index != end_index)
+	if (geometry.fat_width == 32)
 	{
-
-		uint16_t next_index = current_index + 1;
-
-		// Set the current FAT entry to point to the next index
-		fatblock->entry[current_index] = next_index;
-		// Move to the next FAT entry
-		current_index = next_index;
+		return file->first_block_data | (uint32_t)file->first_block_high << 16;
 	}
+	return file->first_block_data == FAT16_EOC ? FAT_EOC : file->first_block_data;
+}
 
-	fatblock->entry[end_index] = FAT_EOC;
+static inline void file_set_first_block(struct RootDirectory *file, uint32_t block)
+{
+	file->first_block_data = block & 0xFFFF;
+	file->first_block_high = geometry.fat_width == 32 ? block >> 16 : 0;
 }
 
-int fs_create(const char *filename)
+// free a whole FAT chain, reading each link once before clearing it; a
+// corrupted chain ends at the first free or out of range entry, and after as
+// many links as there are data blocks at most, so that cycles end too
+static void clear_fat_entries(uint32_t entry_index)
 {
-	if (strlen(filename) * sizeof(char) > FS_FILENAME_LEN)
+	uint32_t lowest = entry_index;
+
+	uint32_t index = entry_index;
+	for (uint32_t hops = 0; index != 0 && index < geometry.data_blocks && hops < geometry.data_blocks; hops++)
 	{
-		return -1;
+		uint32_t next = fat_get(index);
+		fat_set(index, 0);
+		lowest = MIN(lowest, index);
+		index = next;
 	}
 
-	int empty_entry_index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	if (lowest < fat_hint)
 	{
-		// its already in the directory
-		if (strcmp(root_directory[i].filename, filename) == 0)
+		fat_hint = lowest;
+	}
+	chain_hint.first_block = FAT_EOC;
+	chain_epoch++;
+}
+
+// first of @count consecutive free data blocks, searching from @from and then
+// from the start of the FAT, or FAT_EOC when no run is that long
+static uint32_t fat_find_run(uint32_t from, uint32_t count)
+{
+	for (;;)
+	{
+		uint32_t start = fat_find_free(from);
+		while (start != FAT_EOC && start + count <= geometry.data_blocks)
 		{
-			return -1;
+			uint32_t length = fat_free_run(start, count);
+			if (length == count)
+			{
+				return start;
+			}
+			// the entry that ended the run is in use
+			start = fat_find_free(start + length + 1);
 		}
-		if (strcmp(root_directory[i].filename, "") == 0)
+		if (from <= 1)
 		{
-			empty_entry_index = i;
-			break;
+			return FAT_EOC;
 		}
+		from = 1;
 	}
+}
 
-	if (empty_entry_index == -1)
+// cut the chain of @file down to its first @blocks blocks
+static void chain_cut(struct RootDirectory *file, uint32_t blocks)
+{
+	uint32_t first_block = file_first_block(file);
+	if (first_block == FAT_EOC)
 	{
-		return -1;
+		return;
 	}
-
-	strcpy(root_directory[empty_entry_index].filename, filename);
-
-	int file_size = get_file_size(filename);
-	if (file_size == -1)
+	if (blocks == 0)
 	{
-		return -1;
+		clear_fat_entries(first_block);
+		file_set_first_block(file, FAT_EOC);
+		return;
 	}
 
-	if (file_size == 0)
+	uint32_t last_block = fat_walk(first_block, blocks - 1);
+	if (last_block == FAT_EOC)
 	{
-		// for zero sized files, no FAT blocks need to be allocated
-		root_directory[empty_entry_index].size = 0;
-		root_directory[empty_entry_index].first_block_data = FAT_EOC;
-		return 0;
+		return; // already that short
 	}
-
-	// Calculate the number of blocks required to store the file
-	int num_blocks = file_size / BLOCK_SIZE;
-	if (file_size % BLOCK_SIZE != 0)
+	uint32_t rest = fat_get(last_block);
+	if (rest != FAT_EOC)
 	{
-		num_blocks++;
+		fat_set(last_block, FAT_EOC);
+		clear_fat_entries(rest);
 	}
+}
 
-	// Find an empty slot in the FAT to start writing the file
-	int start_block = -1;
-	for (int j = 0; j < FAT_SIZE * superblock->fat_blocks; j++)
+// blocks in the chain of @file, including those reserved past its end
+static size_t chain_blocks(struct RootDirectory *file)
+{
+	size_t blocks = size_blocks(file->size);
+	uint32_t block = file_first_block(file);
+	if (blocks > 0)
 	{
-		if (fatblock->entry[j] == 0)
-		{
-			start_block = j;
-			break;
-		}
+		block = fat_walk(block, blocks - 1);
+		block = block != FAT_EOC ? fat_get(block) : FAT_EOC;
 	}
-	if (start_block == -1)
+	for (; block != FAT_EOC; block = fat_get(block))
 	{
-		return -1;
+		blocks++;
 	}
-
-	root_directory[empty_entry_index].size = file_size; // Write the file size and start block information to the root directory entry
-	root_directory[empty_entry_index].first_block_data = start_block;
-	fill_fat_entries(fatblock, start_block, start_block + num_blocks - 1);
-
-	return 0;
+	return blocks;
 }
 
-void clear_fat_entries(struct FatBlock *fatblock, uint16_t entry_index)
+// extend the chain of @file to @blocks blocks, with one contiguous run of
+// blocks when there is a long enough one, right after the chain if possible
+static int chain_reserve(struct RootDirectory *file, uint32_t blocks)
 {
-	uint16_t index = entry_index;
-
-	// Iterate through the FAT entries until FAT_EOC is encountered
-	while (fatblock->entry[index] != FAT_EOC)
+	uint32_t length = 0;
+	uint32_t last_block = FAT_EOC;
+	for (uint32_t block = file_first_block(file); block != FAT_EOC; block = fat_get(block))
 	{
-		uint16_t current_entry = fatblock->entry[index];
-		fatblock->entry[index] = 0;
-		index = current_entry;
+		last_block = block;
+		length++;
 	}
-
-	if (fatblock->entry[index] == FAT_EOC) // Check if the current entry is EOC
+	if (length >= blocks)
 	{
-		// set the FAT_EOC entry to zero and break out of the loop
-		fatblock->entry[index] = 0;
+		return 0;
 	}
-}
-
-int fs_delete(const char *filename)
-{
 
-	if (root_directory == NULL || superblock == NULL)
+	uint32_t count = blocks - length;
+	uint32_t run = fat_find_run(last_block != FAT_EOC ? last_block + 1 : fat_hint, count);
+	if (run != FAT_EOC)
 	{
-		return -1;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			fat_set(run + i, i + 1 < count ? run + i + 1 : FAT_EOC);
+		}
+		if (last_block == FAT_EOC)
+		{
+			file_set_first_block(file, run);
+		}
+		else
+		{
+			fat_set(last_block, run);
+		}
+		if (fat_hint >= run && fat_hint < run + count)
+		{
+			fat_hint = run + count;
+		}
+		return 0;
 	}
 
-	int file_index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) // search for the file in the root directory
+	// too fragmented: take free blocks wherever they are
+	for (uint32_t i = 0; i < count; i++)
 	{
-		if (strcmp(root_directory[i].filename, filename) == 0)
+		uint32_t block = fat_alloc();
+		if (block == FAT_EOC)
 		{
-			file_index = i;
-			break;
+			chain_cut(file, length); // disk full, reserve nothing
+			return -1;
+		}
+		if (last_block == FAT_EOC)
+		{
+			file_set_first_block(file, block);
+		}
+		else
+		{
+			fat_set(last_block, block);
 		}
+		last_block = block;
 	}
+	return 0;
+}
 
-	if (file_index == -1)
+// block at @index in the chain starting at @first_block, walking from
+// chain_hint when it is on the way there
+static uint32_t chain_seek(uint32_t first_block, size_t index)
+{
+	if (first_block != FAT_EOC && chain_hint.first_block == first_block && chain_hint.index <= index)
 	{
-		return -1;
+		return fat_walk(chain_hint.block, index - chain_hint.index);
 	}
+	return fat_walk(first_block, index);
+}
 
-	clear_fat_entries(fatblock, root_directory[file_index].first_block_data);
-
-	// Clear the entry for the file
-	strcpy(root_directory[file_index].filename, "");
-	root_directory[file_index].size = 0;
-	root_directory[file_index].first_block_data = 0;
+static inline void chain_remember(uint32_t first_block, size_t index, uint32_t block)
+{
+	chain_hint = (struct ChainPosition){first_block, index, block};
+}
 
-	return 0;
+// whether @tail is a position in the current chain of @file
+static inline int tail_valid(const struct ChainTail *tail, const struct RootDirectory *file)
+{
+	return tail != NULL && tail->epoch == chain_epoch && tail->position.first_block == file_first_block(file);
 }
 
-int fs_ls(void)
+// note in @tail that @file was last written at @block, @index links into its
+// chain, keeping a copy of the block when its content @data is known
+static void tail_remember(struct ChainTail *tail, const struct RootDirectory *file, size_t index, uint32_t block,
+						  const char *data)
 {
-	if (block_disk_count() == -1)
+	if (tail == NULL)
 	{
-		return -1;
+		return;
 	}
-
-	printf("FS Ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	tail->position = (struct ChainPosition){file_first_block(file), index, block};
+	tail->epoch = chain_epoch;
+	tail->data_block = FAT_EOC;
+	if (data != NULL && (tail->data != NULL || (tail->data = block_buf_alloc(1)) != NULL))
 	{
-		// Check if an empty entry
-		if (strcmp(root_directory[i].filename, "") != 0)
+		if (data != tail->data)
 		{
-
-			printf("file: %s, ", root_directory[i].filename);
-			printf("Size: %u, ", root_directory[i].size);
-			printf("data_blk: %u\n", root_directory[i].first_block_data);
+			memcpy(tail->data, data, geometry.block_size);
 		}
+		tail->data_block = block;
 	}
-	return 0;
 }
 
-static int numOpen = 0;
-int fs_open(const char *filename)
+// whole-block transfers of the chain being read or written, issued together
+static struct io_batch chain_batch;
+
+// issue the transfers queued in chain_batch, moving the bytes they cover from
+// @queued to @done as far as they succeed; returns -1 if some of them failed
+static int chain_flush(int write, size_t *done, size_t *queued)
 {
+	size_t bytes = (size_t)io_batch_submit(&chain_batch, write) << geometry.block_shift;
+	int ret = bytes == *queued ? 0 : -1;
 
-	// error checking
-	if (numOpen > FS_OPEN_MAX_COUNT)
-	{
-		return -1;
-	}
+	*done += bytes;
+	*queued = 0;
+	return ret;
+}
+
+// read from a FAT chain, starting @start_offset bytes into it
+static int chain_read(uint32_t first_block, size_t start_offset, char *buf, size_t count)
+{
+	size_t index = start_offset >> geometry.block_shift;
+	uint32_t current_block = chain_seek(first_block, index);
+	uint32_t last_block = FAT_EOC;
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	size_t bytes_read = 0;
+	size_t bytes_queued = 0;
+	size_t remaining_bytes = count;
+	char *current_buf = buf;
+	char *bounce_buf = NULL;
+
+	io_batch_init(&chain_batch);
+	while (remaining_bytes > 0 && current_block != FAT_EOC)
 	{
-		// check if the filename equals the arguments passed
-		if (strcmp(root_directory[i].filename, filename) != 0)
+		size_t block_offset = (start_offset + bytes_read + bytes_queued) & (geometry.block_size - 1);
+		size_t bytes_to_read = MIN(geometry.block_size - block_offset, remaining_bytes);
+
+		if (bytes_to_read == geometry.block_size)
 		{
-			// iterate throught the fd array
-			for (int j = 0; j < FS_OPEN_MAX_COUNT; j++)
+			// whole blocks go straight to the user, a batch at a time
+			bytes_queued += geometry.block_size;
+			if (io_batch_add(&chain_batch, geometry.data_start + current_block, current_buf) &&
+				chain_flush(0, &bytes_read, &bytes_queued) < 0)
 			{
-
-				if (strcmp(fileD[j].filename, "") == 0)
-				{ // check an empty spot
-					numOpen++;
-					strcpy(fileD[j].filename, filename);
-					fileD[j].offset = 0;
-
-					return j;
-				}
+				break;
 			}
 		}
-	}
-
-	return -1;
-}
+		else
+		{
+			if (chain_flush(0, &bytes_read, &bytes_queued) < 0)
+			{
+				break;
+			}
+			if (bounce_buf == NULL && (bounce_buf = block_buf_alloc(1)) == NULL)
+			{
+				break;
+			}
+			// Read data from the block into the bounce buffer
+			if (block_read(geometry.data_start + current_block, bounce_buf) < 0)
+			{
+				break;
+			}
+			// Copy data from the bounce buffer to the user
+			memcpy(current_buf, bounce_buf + block_offset, bytes_to_read);
+			bytes_read += bytes_to_read;
+		}
 
-int fs_close(int fd)
-{
-	// Check if the file descriptor is within range
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT)
+		// update everything
+		remaining_bytes -= bytes_to_read;
+		current_buf += bytes_to_read;
+		last_block = current_block;
+		current_block = fat_get(current_block);
+		index++;
+	}
+	chain_flush(0, &bytes_read, &bytes_queued);
+	if (last_block != FAT_EOC)
 	{
-		return -1;
+		chain_remember(first_block, index - 1, last_block);
 	}
-	// Reset values associated with the file descriptor
-	strcpy(fileD[fd].filename, "");
-	fileD[fd].offset = 0;
-	numOpen--;
 
-	return 0;
+	block_buf_free(bounce_buf, 1);
+	return bytes_read;
 }
 
-// get offset/size here
-int fs_stat(int fd)
+// write to a file stored as a FAT chain, allocating blocks past its end;
+// @tail, if not NULL, is where the file was last written and gets updated
+static int chain_write(struct RootDirectory *file, struct ChainTail *tail, size_t start_offset, const char *buf,
+					   size_t count)
 {
-	// error check
-	if (superblock == NULL || root_directory == NULL || fatblock == NULL)
+	// FAT chains cannot have holes: zeros go up to the offset first, and go
+	// again if the disk fills up before any of the data is written
+	if (start_offset > file->size)
 	{
-		return -1;
-	}
+		static const char zeros[BLOCK_SIZE_MAX] __attribute__((aligned(BLOCK_SIZE_MAX)));
+		size_t old_size = file->size;
+		size_t old_blocks = chain_blocks(file);
+		while (file->size < start_offset)
+		{
+			size_t gap = MIN(sizeof(zeros), start_offset - file->size);
+			if (chain_write(file, tail, file->size, zeros, gap) != (int)gap)
+			{
+				break; // disk full
+			}
+		}
 
-	// error check
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || strcmp(fileD[fd].filename, "") == 0)
-	{
-		return -1;
+		int bytes_written = file->size == start_offset ? chain_write(file, tail, start_offset, buf, count) : 0;
+		if (file->size < start_offset || (count > 0 && bytes_written <= 0))
+		{
+			chain_cut(file, old_blocks);
+			file->size = old_size;
+		}
+		return bytes_written;
 	}
 
-	const char *filename = fileD[fd].filename;
-
-	// Search for the file in the root directory
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	// Find the block holding the offset, and the one linking to it. When the
+	// offset is at the end of the chain, current_block is FAT_EOC and gets
+	// allocated below.
+	size_t start_index = start_offset >> geometry.block_shift;
+	uint32_t prev_block = FAT_EOC;
+	uint32_t current_block = file_first_block(file);
+	if (start_index > 0)
 	{
-		if (strcmp(root_directory[i].filename, filename) == 0)
+		if (tail_valid(tail, file) && tail->position.index <= start_index - 1)
+		{
+			prev_block = fat_walk(tail->position.block, start_index - 1 - tail->position.index);
+		}
+		else
 		{
-			// return its size
-			return root_directory[i].size;
+			prev_block = chain_seek(current_block, start_index - 1);
 		}
+		if (prev_block == FAT_EOC)
+		{
+			return -1; // chain shorter than the file size
+		}
+		current_block = fat_get(prev_block);
 	}
 
-	// File not found
-	return -1;
-}
+	size_t end_of_file = file->size;
+	size_t bytes_written = 0;
+	size_t bytes_queued = 0;
+	size_t remaining_bytes = count;
+	const char *current_buf = buf;
+	char *bounce_buf = NULL;
+	const char *last_data = NULL; // content of the last block written
 
-// actually change offset here
-int fs_lseek(int fd, size_t offset)
-{
-	// Check if the file descriptor is valid
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT)
+	io_batch_init(&chain_batch);
+	while (remaining_bytes > 0)
 	{
-		return -1;
-	}
+		// extend the chain by one block when writing past its end
+		if (current_block == FAT_EOC)
+		{
+			current_block = fat_alloc();
+			if (current_block == FAT_EOC)
+			{
+				break; // disk full
+			}
+			if (prev_block == FAT_EOC)
+			{
+				file_set_first_block(file, current_block);
+			}
+			else
+			{
+				fat_set(prev_block, current_block);
+			}
+		}
 
-	fileD[fd].offset = offset;
+		// calculate the offset for writing
+		size_t block_offset = (start_offset + bytes_written + bytes_queued) & (geometry.block_size - 1);
+		// blocks past the end of the file, just allocated or reserved by
+		// fs_fallocate(), hold nothing worth reading back
+		int fresh_block = start_offset + bytes_written + bytes_queued - block_offset >= end_of_file;
+		// find the number of bytes to write
+		size_t bytes_to_write = MIN(geometry.block_size - block_offset, remaining_bytes);
+
+		if (bytes_to_write == geometry.block_size)
+		{
+			// whole blocks go straight from the user, a batch at a time
+			bytes_queued += geometry.block_size;
+			if (io_batch_add(&chain_batch, geometry.data_start + current_block, (char *)current_buf) &&
+				chain_flush(1, &bytes_written, &bytes_queued) < 0)
+			{
+				break;
+			}
+			last_data = current_buf;
+		}
+		else
+		{
+			// partial blocks are merged with what is already on disk, or
+			// with the copy of it kept by @tail
+			if (chain_flush(1, &bytes_written, &bytes_queued) < 0)
+			{
+				break;
+			}
+			char *block_buf;
+			if (!fresh_block && tail_valid(tail, file) && tail->data_block == current_block)
+			{
+				block_buf = tail->data;
+				tail->data_block = FAT_EOC; // until written out
+			}
+			else
+			{
+				if (bounce_buf == NULL && (bounce_buf = block_buf_alloc(1)) == NULL)
+				{
+					break;
+				}
+				block_buf = bounce_buf;
+				if (fresh_block)
+				{
+					memset(block_buf, 0, geometry.block_size);
+				}
+				else if (block_read(geometry.data_start + current_block, block_buf) < 0)
+				{
+					break;
+				}
+			}
+			memcpy(block_buf + block_offset, current_buf, bytes_to_write);
+
+			// Write data from the buffer to the block on disk
+			if (block_write(geometry.data_start + current_block, block_buf) < 0)
+			{
+				break;
+			}
+			bytes_written += bytes_to_write;
+			last_data = block_buf;
+		}
+
+		// Update everything
+		remaining_bytes -= bytes_to_write;
+		current_buf += bytes_to_write;
+		prev_block = current_block;
+		current_block = fat_get(current_block);
+		start_index++;
+	}
+	chain_flush(1, &bytes_written, &bytes_queued);
+	if (prev_block != FAT_EOC)
+	{
+		// the block the next write at the end of the file links from
+		chain_remember(file_first_block(file), start_index - 1, prev_block);
+		tail_remember(tail, file, start_index - 1, prev_block, bytes_written == count ? last_data : NULL);
+	}
+
+	block_buf_free(bounce_buf, 1);
+
+	if (start_offset + bytes_written > file->size)
+	{
+		file->size = start_offset + bytes_written;
+	}
+	return bytes_written;
+}
+
+/*
+ * Small files. With FEATURE_SMALL_FILES, a file that never grew past
+ * INLINE_MAX bytes lives in its directory entry, and one that never grew past
+ * PACK_MAX bytes in a run of fragments of a pack block shared with other small
+ * files. Pack blocks are ordinary one-block FAT chains. The last pack block
+ * used stays in memory, so reading small files created together costs at most
+ * one block read for all of them.
+ */
+
+static inline int small_files(void)
+{
+	return (geometry.features & FEATURE_SMALL_FILES) != 0;
+}
+
+static inline int file_is_small(const struct RootDirectory *file)
+{
+	return (file->flags & (ENTRY_INLINE | ENTRY_PACKED)) != 0;
+}
+
+// data block of a regular file or pack block of a packed one, or FAT_EOC
+static inline uint32_t file_data_block(const struct RootDirectory *file)
+{
+	return file->flags & ENTRY_INLINE ? FAT_EOC : file_first_block(file);
+}
+
+static inline uint32_t pack_fragments(size_t size)
+{
+	return (size + PACK_FRAGMENT - 1) / PACK_FRAGMENT;
+}
+
+static inline uint64_t pack_run(uint32_t first, uint32_t count)
+{
+	return ((UINT64_C(1) << count) - 1) << first;
+}
+
+// first fragment of a free run of @count fragments, or 0 if there is none
+static uint32_t pack_find_run(uint64_t used, uint32_t count)
+{
+	for (uint32_t first = 1; first + count <= PACK_FRAGMENTS; first++)
+	{
+		if ((used & pack_run(first, count)) == 0)
+		{
+			return first;
+		}
+	}
 	return 0;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+static struct PackHeader *pack_load(uint32_t block)
 {
+	if (pack_buf == NULL && (pack_buf = block_buf_alloc(1)) == NULL)
+	{
+		return NULL;
+	}
+	if (pack_cached != block)
+	{
+		pack_cached = FAT_EOC;
+		if (block_read(geometry.data_start + block, pack_buf) < 0)
+		{
+			return NULL;
+		}
+		pack_cached = block;
+	}
+	return (struct PackHeader *)pack_buf;
+}
 
-	if (superblock == NULL || root_directory == NULL || fatblock == NULL)
+// take a new, empty pack block out of the FAT, or FAT_EOC when the disk is full
+static uint32_t pack_new(void)
+{
+	if (pack_buf == NULL && (pack_buf = block_buf_alloc(1)) == NULL)
 	{
-		return -1;
+		return FAT_EOC;
 	}
 
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || strcmp(fileD[fd].filename, "") == 0)
+	uint32_t block = fat_alloc();
+	if (block != FAT_EOC)
 	{
-		return -1;
+		memset(pack_buf, 0, BLOCK_SIZE);
+		((struct PackHeader *)pack_buf)->used = 1;
+		pack_cached = block;
 	}
+	return block;
+}
 
-	if (buf == NULL)
+static inline int pack_store(void)
+{
+	return block_write(geometry.data_start + pack_cached, pack_buf);
+}
+
+// give the fragments of a packed file back, and its pack block once empty
+static int pack_release(const struct RootDirectory *file)
+{
+	uint32_t block = file_first_block(file);
+	struct PackHeader *pack = pack_load(block);
+	if (pack == NULL)
 	{
 		return -1;
 	}
 
-	// Retrieve the filename associated with the fd
-	const char *filename = fileD[fd].filename;
-	size_t start_offset = fileD[fd].offset;
+	pack->used &= ~pack_run(file->fragment, pack_fragments(file->size));
+	if (pack->used == 1)
+	{
+		pack_cached = FAT_EOC;
+		if (pack_hint == block)
+		{
+			pack_hint = FAT_EOC;
+		}
+		if (block < fat_hint)
+		{
+			fat_hint = block;
+		}
+		return fat_set(block, 0);
+	}
 
-	size_t start_block;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	if (pack_hint == FAT_EOC)
 	{
+		pack_hint = block;
+	}
+	return pack_store();
+}
 
-		if (strcmp(root_directory[i].filename, filename) == 0)
+// copy the content of a small file to @data, which holds PACK_MAX bytes
+static int small_load(const struct RootDirectory *file, char *data)
+{
+	if (file->flags & ENTRY_INLINE)
+	{
+		memcpy(data, file->inline_data, file->size);
+	}
+	else if (file->flags & ENTRY_PACKED)
+	{
+		if (pack_load(file_first_block(file)) == NULL)
 		{
-			start_block = root_directory[i].first_block_data;
+			return -1;
 		}
+		memcpy(data, pack_buf + file->fragment * PACK_FRAGMENT, file->size);
 	}
+	return 0;
+}
 
-	// Calculate the starting and ending block indices for the write operation
-	size_t num_blocks = (count + BLOCK_SIZE - 1) / BLOCK_SIZE; // Round up division
-	size_t end_block = start_block + num_blocks - 1;
-	size_t bytes_written = 0;
-	size_t remaining_bytes = count;
-	void *current_buf = buf;
+static int small_read(const struct RootDirectory *file, size_t start_offset, char *buf, size_t count)
+{
+	if (file->flags & ENTRY_INLINE)
+	{
+		memcpy(buf, file->inline_data + start_offset, count);
+	}
+	else
+	{
+		if (pack_load(file_first_block(file)) == NULL)
+		{
+			return -1;
+		}
+		memcpy(buf, pack_buf + file->fragment * PACK_FRAGMENT + start_offset, count);
+	}
+	return count;
+}
 
-	for (size_t block_index = start_block; block_index <= end_block; block_index++)
+// make @data, @size bytes long, the content of a small or empty file
+static int small_store(struct RootDirectory *file, const char *data, size_t size)
+{
+	if (size <= INLINE_MAX)
 	{
-		// calculate the offset for writing
-		size_t block_offset = (block_index == start_block) ? (start_offset % BLOCK_SIZE) : 0;
-		// find the number of bytes to write
-		size_t bytes_to_write = MIN(BLOCK_SIZE - block_offset, remaining_bytes);
-		// Write data from the buffer to the block on disk
-		if (block_write(superblock->data_start + block_index, (char *)current_buf) < 0)
+		if ((file->flags & ENTRY_PACKED) && pack_release(file) < 0)
 		{
 			return -1;
 		}
+		memset(file->inline_data, 0, INLINE_MAX);
+		memcpy(file->inline_data, data, size);
+		file->flags = (file->flags & ENTRY_MAPPED) | ENTRY_INLINE;
+		file->size = size;
+		return 0;
+	}
 
-		// Update everything
-		bytes_written += bytes_to_write;
-		remaining_bytes -= bytes_to_write;
-		current_buf += bytes_to_write;
+	uint32_t count = pack_fragments(size);
+	uint32_t old_block = file->flags & ENTRY_PACKED ? file_first_block(file) : FAT_EOC;
+	uint64_t old_run = old_block != FAT_EOC ? pack_run(file->fragment, pack_fragments(file->size)) : 0;
+
+	// grow in place when possible, otherwise move to the first pack block with
+	// room: the current one, the hinted one, or a new one
+	uint32_t block = FAT_EOC;
+	uint32_t first = 0;
+	struct PackHeader *pack;
+	if (old_block != FAT_EOC && (pack = pack_load(old_block)) != NULL)
+	{
+		first = pack_find_run(pack->used & ~old_run, count);
+		block = first != 0 ? old_block : FAT_EOC;
+	}
+	if (block == FAT_EOC && pack_hint != FAT_EOC && pack_hint != old_block &&
+		(pack = pack_load(pack_hint)) != NULL && (first = pack_find_run(pack->used, count)) != 0)
+	{
+		block = pack_hint;
+	}
+	if (block == FAT_EOC)
+	{
+		block = pack_new();
+		if (block == FAT_EOC)
+		{
+			return -1; // disk full
+		}
+		pack_hint = block;
+		first = 1;
 	}
 
-	fileD[fd].offset += bytes_written;
-	return bytes_written;
+	pack = pack_load(block);
+	if (block == old_block)
+	{
+		pack->used &= ~old_run;
+	}
+	pack->used |= pack_run(first, count);
+	memcpy(pack_buf + first * PACK_FRAGMENT, data, size);
+	if (pack_store() < 0)
+	{
+		return -1;
+	}
+
+	if (old_block != FAT_EOC && old_block != block && pack_release(file) < 0)
+	{
+		return -1;
+	}
+	file_set_first_block(file, block);
+	file->fragment = first;
+	memset(file->padding, 0, sizeof(file->padding));
+	file->flags = (file->flags & ENTRY_MAPPED) | ENTRY_PACKED;
+	file->size = size;
+	return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/*
+ * Mapped files. With FEATURE_COMPRESSION or FEATURE_DEDUP, the FAT chain of a
+ * file holds its chunk map rather than its data: one struct ChunkMap per chunk
+ * of content, each chunk being stored in its own FAT chain.
+ *
+ * With FEATURE_COMPRESSION, chunks are LZ compressed unless that would not
+ * save at least one block. Reading or writing part of a file only
+ * decompresses the chunks it touches, and chunks stored as they are can be
+ * read block by block without going through chunk_buf at all.
+ *
+ * With FEATURE_DEDUP, a chunk whose content is already stored somewhere
+ * points there instead of being written again. The refcount table counts the
+ * references to each stored chunk beyond the first one, so that chunks never
+ * shared need no update to it, and shared chunks are copied when written to.
+ *
+ * With FEATURE_CLONES (or FEATURE_DEDUP), fs_clone() copies the chunk map of
+ * a file and shares all its chunks through the same refcount table.
+ */
+
+static inline int dedup_enabled(void)
 {
-	// error checking
-	if (superblock == NULL || root_directory == NULL || fatblock == NULL)
+	return (geometry.features & FEATURE_DEDUP) != 0;
+}
+
+static inline int refs_enabled(void)
+{
+	return (geometry.features & FEATURE_REFS) != 0;
+}
+
+static inline size_t chunk_size(void)
+{
+	return geometry.chunk_blocks * BLOCK_SIZE;
+}
+
+static inline uint32_t chunk_blocks(size_t length)
+{
+	return (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static inline uint16_t ref_get(uint32_t block)
+{
+	uint16_t *refs = pager_get(&ref_pager, block / REFS_SIZE, 0);
+	return refs != NULL ? refs[block % REFS_SIZE] : REFS_MAX;
+}
+
+static inline int ref_set(uint32_t block, uint16_t count)
+{
+	uint16_t *refs = pager_get(&ref_pager, block / REFS_SIZE, 1);
+	if (refs == NULL)
 	{
 		return -1;
 	}
+	refs[block % REFS_SIZE] = count;
+	return 0;
+}
 
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || strcmp(fileD[fd].filename, "") == 0)
+static int chunk_buffers(void)
+{
+	if ((map_buf == NULL && (map_buf = block_buf_alloc(1)) == NULL) ||
+		(chunk_buf == NULL && (chunk_buf = block_buf_alloc(CHUNK_BLOCKS)) == NULL) ||
+		(lz_buf == NULL && (lz_buf = block_buf_alloc(CHUNK_BLOCKS)) == NULL) ||
+		(verify_buf == NULL && dedup_enabled() && (verify_buf = block_buf_alloc(CHUNK_BLOCKS)) == NULL))
 	{
 		return -1;
 	}
+	return 0;
+}
 
-	if (buf == NULL)
+static int map_flush(void)
+{
+	if (map_dirty)
+	{
+		if (block_write(geometry.data_start + map_cached, map_buf) < 0)
+		{
+			return -1;
+		}
+		map_dirty = 0;
+	}
+	return 0;
+}
+
+// bring map block @block into map_buf, as an empty one if @fresh
+static int map_load(uint32_t block, int fresh)
+{
+	if (map_cached == block)
+	{
+		return 0;
+	}
+	if (map_flush() < 0)
 	{
 		return -1;
 	}
 
-	// Retrieve the filename associated with the file descriptor
-	const char *filename = fileD[fd].filename;
-	// Get the starting offset and size
-	size_t start_offset = fileD[fd].offset;
-	size_t file_size = get_file_size(filename);
+	map_cached = FAT_EOC;
+	if (fresh)
+	{
+		memset(map_buf, 0, BLOCK_SIZE);
+	}
+	else if (block_read(geometry.data_start + block, map_buf) < 0)
+	{
+		return -1;
+	}
+	map_cached = block;
+	map_dirty = fresh;
+	return 0;
+}
 
-	// doesn't exceed the file size
-	if (start_offset + count > file_size)
+// map entry of chunk @index, or NULL; with @create, missing map blocks are
+// added and the entry is expected to be modified, otherwise chunks past the
+// end of the map are holes
+static struct ChunkMap *map_entry(struct RootDirectory *file, uint32_t index, int create)
+{
+	static struct ChunkMap hole;
+	uint32_t prev = FAT_EOC;
+	uint32_t block = file_first_block(file);
+
+	for (uint32_t page = 0;; page++)
 	{
-		count = file_size - start_offset;
+		if (block == FAT_EOC)
+		{
+			if (!create)
+			{
+				return &hole;
+			}
+			if ((block = fat_alloc()) == FAT_EOC)
+			{
+				return NULL;
+			}
+			if (prev == FAT_EOC)
+			{
+				file_set_first_block(file, block);
+			}
+			else
+			{
+				fat_set(prev, block);
+			}
+			if (map_load(block, 1) < 0)
+			{
+				return NULL;
+			}
+		}
+		if (page == index / MAP_ENTRIES)
+		{
+			break;
+		}
+		prev = block;
+		block = fat_get(block);
+	}
+
+	if (map_load(block, 0) < 0)
+	{
+		return NULL;
 	}
+	map_dirty |= create;
+	return &map_buf[index % MAP_ENTRIES];
+}
 
-	size_t start_block;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+// uncompressed content of a chunk, @length bytes long; what was not stored
+// because the file was shorter then reads as zeros
+static char *chunk_load(const struct ChunkMap *map, size_t length)
+{
+	if (map->block == 0)
+	{
+		chunk_cached = FAT_EOC;
+		memset(chunk_buf, 0, length);
+		return chunk_buf;
+	}
+	if (chunk_cached == map->block)
 	{
+		if (chunk_cached_length < length)
+		{
+			memset(chunk_buf + chunk_cached_length, 0, length - chunk_cached_length);
+			chunk_cached_length = length;
+		}
+		return chunk_buf;
+	}
 
-		if (strcmp(root_directory[i].filename, filename) == 0)
+	chunk_cached = FAT_EOC;
+	long stored_length;
+	if (map->flags & CHUNK_LZ)
+	{
+		if (chain_read(map->block, 0, lz_buf, map->length) != map->length ||
+			(stored_length = lz_decompress(lz_buf, map->length, chunk_buf, CHUNK_SIZE)) < 0)
+		{
+			return NULL;
+		}
+	}
+	else
+	{
+		stored_length = MIN(length, map->length);
+		if (chain_read(map->block, 0, chunk_buf, stored_length) != stored_length)
 		{
-			start_block = root_directory[i].first_block_data;
+			return NULL;
 		}
 	}
+	if ((size_t)stored_length < length)
+	{
+		memset(chunk_buf + stored_length, 0, length - stored_length);
+	}
+	chunk_cached = map->block;
+	chunk_cached_length = MAX((size_t)stored_length, length);
+	return chunk_buf;
+}
 
-	// Calculate the starting and ending block indices for the read operation
-	size_t num_blocks = file_size / BLOCK_SIZE;
-	size_t end_block = start_block + num_blocks;
+// drop a reference to a chunk, freeing it along with its last reference
+static void chunk_release(const struct ChunkMap *map)
+{
+	if (map->block == 0)
+	{
+		return;
+	}
 
-	size_t bytes_read = 0;
-	size_t remaining_bytes = count;
-	void *current_buf = buf;
-	void *bounce_buf = malloc(BLOCK_SIZE); // allocate memory
+	if (refs_enabled())
+	{
+		uint16_t refs = ref_get(map->block);
+		if (refs > 0)
+		{
+			ref_set(map->block, refs - 1);
+			return;
+		}
+	}
+	if (dedup_enabled())
+	{
+		dedup_remove(&dedup, map->fingerprint, map->block);
+	}
+	if (chunk_cached == map->block)
+	{
+		chunk_cached = FAT_EOC;
+	}
+	clear_fat_entries(map->block);
+}
+
+// first block of a stored chunk holding exactly @stored, or FAT_EOC
+static uint32_t chunk_find(uint64_t fingerprint, const char *stored, size_t stored_length, uint16_t flags)
+{
+	const struct dedup_entry *entry = dedup_lookup(&dedup, fingerprint);
+	if (entry == NULL || entry->length != stored_length || entry->flags != flags || ref_get(entry->block) == REFS_MAX)
+	{
+		return FAT_EOC;
+	}
+
+	// fingerprints can collide, only share chunks known to be identical
+	uint32_t block = entry->block;
+	if (chain_read(block, 0, verify_buf, stored_length) != (int)stored_length ||
+		memcmp(verify_buf, stored, stored_length) != 0)
+	{
+		return FAT_EOC;
+	}
+	return block;
+}
+
+static int all_zeros(const char *data, size_t length)
+{
+	return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
 
-	for (size_t block_index = start_block; block_index <= end_block; block_index++)
+// store the @length bytes of chunk_buf as the content of a chunk
+static int chunk_store(struct ChunkMap *map, size_t length)
+{
+	// zeros are left as a hole
+	if (all_zeros(chunk_buf, length))
 	{
+		chunk_release(map);
+		memset(map, 0, sizeof(*map));
+		chunk_cached = FAT_EOC;
+		return 0;
+	}
+
+	char *stored = chunk_buf;
+	size_t stored_length = length;
+	uint16_t flags = 0;
 
-		size_t block_offset = (block_index == start_block) ? (start_offset % BLOCK_SIZE) : 0;
-		size_t bytes_to_read = MIN(BLOCK_SIZE - block_offset, remaining_bytes);
-		// Read data from the block into the bounce buffer
-		if (block_read(superblock->data_start + block_index, bounce_buf) < 0)
+	// chunks that do not compress by at least one block are kept as they are
+	if (chunk_blocks(length) > 1)
+	{
+		size_t lz_length = lz_compress(chunk_buf, length, lz_buf, (chunk_blocks(length) - 1) * BLOCK_SIZE);
+		if (lz_length != 0)
 		{
-			free(bounce_buf);
-			return -1;
+			stored = lz_buf;
+			stored_length = lz_length;
+			flags = CHUNK_LZ;
 		}
+	}
+	uint32_t nblocks = chunk_blocks(stored_length);
+	memset(stored + stored_length, 0, nblocks * BLOCK_SIZE - stored_length);
 
-		// Copy data from the bounce buffer to the user
-		memcpy((char *)current_buf, (char *)bounce_buf + block_offset, bytes_to_read);
+	// content already stored: share it rather than write it again
+	uint64_t fingerprint = 0;
+	if (dedup_enabled())
+	{
+		fingerprint = dedup_fingerprint(chunk_buf, length);
 
-		// update everything
-		bytes_read += bytes_to_read;
-		remaining_bytes -= bytes_to_read;
-		current_buf += bytes_to_read;
+		uint32_t block = chunk_find(fingerprint, stored, stored_length, flags);
+		if (block != FAT_EOC)
+		{
+			if (block != map->block)
+			{
+				if (ref_set(block, ref_get(block) + 1) < 0)
+				{
+					return -1;
+				}
+				chunk_release(map);
+			}
+			*map = (struct ChunkMap){block, stored_length, flags, fingerprint};
+			chunk_cached = block;
+			chunk_cached_length = length;
+			return 0;
+		}
 	}
 
-	fileD[fd].offset += bytes_read;
-	free(bounce_buf);
-	return bytes_read;
-}
\ No newline at end of file
+	// reuse the blocks of the previous version, adding or dropping some,
+	// unless other files share them
+	int shared = map->block != 0 && refs_enabled() && ref_get(map->block) > 0;
+	uint32_t first = map->block != 0 && !shared ? map->block : FAT_EOC;
+	uint32_t chain[CHUNK_BLOCKS];
+	uint32_t prev = FAT_EOC;
+	uint32_t block = first;
+	for (uint32_t i = 0; i < nblocks; i++)
+	{
+		if (block == FAT_EOC)
+		{
+			block = fat_alloc();
+			if (block == FAT_EOC)
+			{
+				if (first == FAT_EOC && i > 0)
+				{
+					clear_fat_entries(chain[0]);
+				}
+				return -1; // disk full
+			}
+			if (prev != FAT_EOC)
+			{
+				fat_set(prev, block);
+			}
+		}
+		chain[i] = block;
+		prev = block;
+		block = fat_get(block);
+	}
+	if (block != FAT_EOC)
+	{
+		fat_set(prev, FAT_EOC);
+		clear_fat_entries(block);
+	}
+
+	// one write per run of consecutive blocks
+	for (uint32_t i = 0; i < nblocks;)
+	{
+		struct iovec iov[CHUNK_BLOCKS];
+		uint32_t run = 0;
+		do
+		{
+			iov[run].iov_base = stored + (i + run) * BLOCK_SIZE;
+			iov[run].iov_len = BLOCK_SIZE;
+			run++;
+		} while (i + run < nblocks && chain[i + run] == chain[i] + run);
+
+		if (block_writev(geometry.data_start + chain[i], iov, run) < 0)
+		{
+			return -1;
+		}
+		i += run;
+	}
+
+	if (shared)
+	{
+		chunk_release(map);
+	}
+	else if (map->block != 0 && dedup_enabled())
+	{
+		dedup_remove(&dedup, map->fingerprint, map->block);
+	}
+	*map = (struct ChunkMap){chain[0], stored_length, flags, fingerprint};
+	chunk_cached = chain[0];
+	chunk_cached_length = length;
+	if (dedup_enabled())
+	{
+		struct dedup_entry entry = {fingerprint, chain[0], stored_length, flags};
+		dedup_insert(&dedup, &entry);
+	}
+	return 0;
+}
+
+static int map_write(struct RootDirectory *file, size_t start_offset, const char *buf, size_t count)
+{
+	if (chunk_buffers() < 0)
+	{
+		return -1;
+	}
+
+	size_t size = chunk_size();
+	size_t bytes_written = 0;
+	while (bytes_written < count)
+	{
+		size_t offset = start_offset + bytes_written;
+		size_t chunk_offset = offset % size;
+		size_t chunk_start = offset - chunk_offset;
+		size_t bytes_to_write = MIN(size - chunk_offset, count - bytes_written);
+		size_t old_length = file->size > chunk_start ? MIN(size, file->size - chunk_start) : 0;
+		size_t new_length = MAX(old_length, chunk_offset + bytes_to_write);
+
+		struct ChunkMap *map = map_entry(file, offset / size, 1);
+		if (map == NULL)
+		{
+			break;
+		}
+
+		// only chunks partly overwritten need their previous content, and
+		// zeros up to the offset in case it is past their end
+		if (chunk_offset > 0 || bytes_to_write < old_length)
+		{
+			if (chunk_load(map, old_length) == NULL)
+			{
+				break;
+			}
+			if (chunk_offset > old_length)
+			{
+				memset(chunk_buf + old_length, 0, chunk_offset - old_length);
+			}
+		}
+		chunk_cached = FAT_EOC;
+		memcpy(chunk_buf + chunk_offset, buf + bytes_written, bytes_to_write);
+
+		if (chunk_store(map, new_length) < 0)
+		{
+			break;
+		}
+		bytes_written += bytes_to_write;
+		if (offset + bytes_to_write > file->size)
+		{
+			file->size = offset + bytes_to_write;
+		}
+	}
+
+	if (map_flush() < 0)
+	{
+		return -1;
+	}
+	return bytes_written;
+}
+
+static int map_read(struct RootDirectory *file, size_t start_offset, char *buf, size_t count)
+{
+	if (chunk_buffers() < 0)
+	{
+		return -1;
+	}
+
+	size_t size = chunk_size();
+	size_t bytes_read = 0;
+	while (bytes_read < count)
+	{
+		size_t offset = start_offset + bytes_read;
+		size_t chunk_offset = offset % size;
+		size_t chunk_start = offset - chunk_offset;
+		size_t bytes_to_read = MIN(size - chunk_offset, count - bytes_read);
+
+		struct ChunkMap *map = map_entry(file, offset / size, 0);
+		if (map == NULL)
+		{
+			break;
+		}
+
+		if (map->block != 0 && !(map->flags & CHUNK_LZ))
+		{
+			// stored as is: read only the blocks asked for
+			size_t stored = map->length > chunk_offset ? MIN(bytes_to_read, map->length - chunk_offset) : 0;
+			if (stored > 0 && chain_read(map->block, chunk_offset, buf + bytes_read, stored) != (int)stored)
+			{
+				break;
+			}
+			memset(buf + bytes_read + stored, 0, bytes_to_read - stored);
+		}
+		else
+		{
+			const char *data = chunk_load(map, MIN(size, file->size - chunk_start));
+			if (data == NULL)
+			{
+				break;
+			}
+			memcpy(buf + bytes_read, data + chunk_offset, bytes_to_read);
+		}
+		bytes_read += bytes_to_read;
+	}
+	return bytes_read;
+}
+
+// drop the chunks and free the chunk map of a mapped file
+static int map_release(struct RootDirectory *file)
+{
+	uint32_t first_block = file_first_block(file);
+
+	if (chunk_buffers() < 0)
+	{
+		return -1;
+	}
+	for (uint32_t block = first_block; block != FAT_EOC; block = fat_get(block))
+	{
+		if (map_load(block, 0) < 0)
+		{
+			return -1;
+		}
+		for (uint32_t i = 0; i < MAP_ENTRIES; i++)
+		{
+			chunk_release(&map_buf[i]);
+		}
+	}
+
+	map_cached = FAT_EOC;
+	map_dirty = 0;
+	if (first_block != FAT_EOC)
+	{
+		clear_fat_entries(first_block);
+	}
+	return 0;
+}
+
+// shrink a mapped file to @size bytes, dropping the chunks past the new end
+// and the map blocks no longer needed
+static int map_truncate(struct RootDirectory *file, size_t size)
+{
+	if (chunk_buffers() < 0)
+	{
+		return -1;
+	}
+
+	size_t csize = chunk_size();
+	uint32_t chunks = (size + csize - 1) / csize;
+
+	// the chunk the file now ends in keeps only what is before the end, so
+	// that growing the file again brings back zeros
+	size_t tail = size % csize;
+	if (tail > 0)
+	{
+		size_t chunk_start = size - tail;
+		struct ChunkMap *map = map_entry(file, chunks - 1, 0);
+		if (map == NULL)
+		{
+			return -1;
+		}
+		if (map->block != 0)
+		{
+			if (chunk_load(map, MIN(csize, file->size - chunk_start)) == NULL)
+			{
+				return -1;
+			}
+			chunk_cached = FAT_EOC;
+			map_dirty = 1;
+			if (chunk_store(map, tail) < 0)
+			{
+				return -1;
+			}
+		}
+	}
+
+	uint32_t page = chunks / MAP_ENTRIES;
+	uint32_t keep_pages = (chunks + MAP_ENTRIES - 1) / MAP_ENTRIES;
+	for (uint32_t block = fat_walk(file_first_block(file), page); block != FAT_EOC; block = fat_get(block), page++)
+	{
+		if (map_load(block, 0) < 0)
+		{
+			return -1;
+		}
+		for (uint32_t i = 0; i < MAP_ENTRIES; i++)
+		{
+			if (page * MAP_ENTRIES + i >= chunks && map_buf[i].block != 0)
+			{
+				chunk_release(&map_buf[i]);
+				memset(&map_buf[i], 0, sizeof(map_buf[i]));
+				map_dirty |= page < keep_pages; // the others are freed below
+			}
+		}
+	}
+
+	if (map_flush() < 0)
+	{
+		return -1;
+	}
+	map_cached = FAT_EOC;
+	chain_cut(file, keep_pages);
+	file->size = size;
+	return 0;
+}
+
+// give @clone a chunk map of its own, sharing all the chunks of @file
+static int map_clone(struct RootDirectory *file, struct RootDirectory *clone)
+{
+	struct ChunkMap *page = block_buf_alloc(1);
+	if (page == NULL || chunk_buffers() < 0)
+	{
+		block_buf_free(page, 1);
+		return -1;
+	}
+
+	size_t csize = chunk_size();
+	uint32_t index = 0;
+	uint32_t prev = FAT_EOC;
+	int ret = 0;
+	for (uint32_t block = file_first_block(file); block != FAT_EOC; block = fat_get(block))
+	{
+		if (map_load(block, 0) < 0)
+		{
+			ret = -1;
+			break;
+		}
+		memcpy(page, map_buf, BLOCK_SIZE);
+
+		uint32_t i;
+		for (i = 0; i < MAP_ENTRIES; i++, index++)
+		{
+			if (page[i].block == 0)
+			{
+				continue;
+			}
+			uint16_t refs = ref_get(page[i].block);
+			if (refs < REFS_MAX)
+			{
+				if (ref_set(page[i].block, refs + 1) < 0)
+				{
+					break;
+				}
+				continue;
+			}
+
+			// shared as many times as can be counted: copy this one
+			size_t length = MIN(csize, file->size - (size_t)index * csize);
+			struct ChunkMap copy = {0};
+			if (chunk_load(&page[i], length) == NULL)
+			{
+				break;
+			}
+			chunk_cached = FAT_EOC;
+			if (chunk_store(&copy, length) < 0)
+			{
+				break;
+			}
+			page[i] = copy;
+		}
+
+		// the map block is only linked in once written, so that a failure
+		// leaves a map that can be released
+		uint32_t copy_block = FAT_EOC;
+		if (i < MAP_ENTRIES || (copy_block = fat_alloc()) == FAT_EOC ||
+			block_write(geometry.data_start + copy_block, page) < 0)
+		{
+			for (uint32_t j = 0; j < i; j++)
+			{
+				chunk_release(&page[j]);
+			}
+			if (copy_block != FAT_EOC)
+			{
+				fat_set(copy_block, 0);
+			}
+			ret = -1;
+			break;
+		}
+		if (prev == FAT_EOC)
+		{
+			file_set_first_block(clone, copy_block);
+		}
+		else
+		{
+			fat_set(prev, copy_block);
+		}
+		prev = copy_block;
+	}
+
+	block_buf_free(page, 1);
+	if (ret < 0)
+	{
+		map_release(clone);
+		file_set_first_block(clone, FAT_EOC);
+	}
+	return ret;
+}
+
+// write to a file that is not small, whatever the way it is stored; @tail
+// is as for chain_write()
+static int file_write(struct RootDirectory *file, struct ChainTail *tail, size_t start_offset, const char *buf,
+					  size_t count)
+{
+	if (file->flags & ENTRY_MAPPED)
+	{
+		return map_write(file, start_offset, buf, count);
+	}
+	return chain_write(file, tail, start_offset, buf, count);
+}
+
+// free all the blocks a file takes up, whatever the way it is stored
+static int file_release(struct RootDirectory *file)
+{
+	if (file->flags & ENTRY_INLINE)
+	{
+		return 0;
+	}
+	if (file->flags & ENTRY_PACKED)
+	{
+		return pack_release(file);
+	}
+	if (file->flags & ENTRY_MAPPED)
+	{
+		return map_release(file);
+	}
+	if (file_first_block(file) != FAT_EOC)
+	{
+		clear_fat_entries(file_first_block(file));
+	}
+	return 0;
+}
+
+// give @clone a copy of the content of @file, for files whose blocks cannot
+// be shared
+static int file_copy(struct RootDirectory *file, struct RootDirectory *clone)
+{
+	char *buf = block_buf_alloc(CHUNK_BLOCKS);
+	if (buf == NULL)
+	{
+		return -1;
+	}
+
+	int ret = 0;
+	for (size_t offset = 0; offset < file->size; offset += CHUNK_SIZE)
+	{
+		size_t count = MIN(CHUNK_SIZE, file->size - offset);
+		int bytes_read = file->flags & ENTRY_MAPPED ? map_read(file, offset, buf, count)
+													: chain_read(file_first_block(file), offset, buf, count);
+		if (bytes_read != (int)count || file_write(clone, NULL, offset, buf, count) != (int)count)
+		{
+			ret = -1;
+			break;
+		}
+	}
+
+	block_buf_free(buf, CHUNK_BLOCKS);
+	if (ret < 0)
+	{
+		file_release(clone);
+		file_set_first_block(clone, FAT_EOC);
+		clone->size = 0;
+	}
+	return ret;
+}
+
+/*
+ * Root directory. Its blocks are loaded on first use and then stay resident
+ * (dir_pager never evicts), so entry pointers remain valid until unmount.
+ * A single-block directory is a plain array of entries; a longer one is a
+ * hash table of blocks searched with linear probing, so that finding,
+ * creating or deleting a file reads a single block in the common case.
+ */
+
+static inline int dir_hashed(void)
+{
+	return geometry.dir_blocks > 1;
+}
+
+// first entry of a directory block that can hold a file
+static inline uint32_t dir_first_entry(void)
+{
+	return dir_hashed() ? 1 : 0;
+}
+
+static inline uint32_t dir_capacity(void)
+{
+	return geometry.dir_blocks * (geometry.dir_entries - dir_first_entry());
+}
+
+static struct RootDirectory *dir_entry(struct DirSlot slot, int dirty)
+{
+	struct RootDirectory *entries = pager_get(&dir_pager, slot.block, dirty);
+	return entries != NULL ? &entries[slot.index] : NULL;
+}
+
+// FNV-1a
+static uint32_t dir_hash(const char *filename)
+{
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++)
+	{
+		hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// entry of file @filename, or NULL; its location goes to @slot if not NULL
+static struct RootDirectory *find_file(const char *filename, struct DirSlot *slot)
+{
+	if (filename[0] == '\0')
+	{
+		return NULL;
+	}
+
+	uint32_t block = dir_hash(filename) % geometry.dir_blocks;
+
+	for (uint32_t probe = 0; probe < geometry.dir_blocks; probe++)
+	{
+		struct RootDirectory *entries = pager_get(&dir_pager, block, 0);
+		if (entries == NULL)
+		{
+			return NULL;
+		}
+
+		for (uint32_t i = dir_first_entry(); i < geometry.dir_entries; i++)
+		{
+			if (entries[i].filename[0] == filename[0] &&
+				strncmp(entries[i].filename, filename, FS_FILENAME_LEN) == 0)
+			{
+				if (slot != NULL)
+				{
+					*slot = (struct DirSlot){block, i};
+				}
+				return &entries[i];
+			}
+		}
+
+		// files hashing here were never pushed past this block
+		if (!dir_hashed() || !((struct DirBucket *)entries)->overflow)
+		{
+			break;
+		}
+		block = (block + 1) % geometry.dir_blocks;
+	}
+	return NULL;
+}
+
+// claim an empty entry for @filename, which must not exist yet
+static struct RootDirectory *dir_insert(const char *filename, struct DirSlot *slot)
+{
+	uint32_t block = dir_hash(filename) % geometry.dir_blocks;
+
+	for (uint32_t probe = 0; probe < geometry.dir_blocks; probe++)
+	{
+		struct RootDirectory *entries = pager_get(&dir_pager, block, 1);
+		if (entries == NULL)
+		{
+			return NULL;
+		}
+
+		struct DirBucket *bucket = (struct DirBucket *)entries;
+		if (!dir_hashed() || bucket->used < geometry.dir_entries - 1)
+		{
+			for (uint32_t i = dir_first_entry(); i < geometry.dir_entries; i++)
+			{
+				if (entries[i].filename[0] == '\0')
+				{
+					if (dir_hashed())
+					{
+						bucket->used++;
+					}
+					memset(&entries[i], 0, sizeof(entries[i]));
+					strcpy(entries[i].filename, filename);
+					*slot = (struct DirSlot){block, i};
+					return &entries[i];
+				}
+			}
+		}
+
+		if (!dir_hashed())
+		{
+			break;
+		}
+		bucket->overflow = 1;
+		block = (block + 1) % geometry.dir_blocks;
+	}
+	return NULL;
+}
+
+static void dir_remove(struct DirSlot slot)
+{
+	struct RootDirectory *entries = pager_get(&dir_pager, slot.block, 1);
+
+	memset(&entries[slot.index], 0, sizeof(entries[slot.index]));
+	if (dir_hashed())
+	{
+		((struct DirBucket *)entries)->used--;
+	}
+}
+
+/*
+ * File descriptors. Descriptors index a table that starts small and doubles
+ * when full, and is only moved then. The lowest free descriptor is found
+ * through two levels of bitmaps, the second one flagging the words of the
+ * first with no free bit, so that opening and closing take a few word scans
+ * whatever the number of open files. Each directory entry counts the
+ * descriptors open on it, for fs_delete().
+ */
+
+static inline uint32_t *open_counter(struct DirSlot slot)
+{
+	return &open_count[(size_t)slot.block * geometry.dir_entries + slot.index];
+}
+
+static inline struct ChainTail *slot_tail(struct DirSlot slot)
+{
+	return &chain_tails[(size_t)slot.block * geometry.dir_entries + slot.index];
+}
+
+static int is_open(struct DirSlot slot)
+{
+	return open_count != NULL && *open_counter(slot) != 0;
+}
+
+static int valid_fd(int fd)
+{
+	return superblock != NULL && fd >= 0 && (uint32_t)fd < fd_capacity && (fd_used[fd / 64] >> (fd % 64)) & 1;
+}
+
+static int fd_grow(void)
+{
+	uint32_t capacity = fd_capacity != 0 ? MIN(fd_capacity * 2, FS_OPEN_MAX_COUNT) : FD_TABLE_INITIAL;
+	struct FileDescriptor *table = aligned_alloc(64, capacity * sizeof(*table));
+	if (table == NULL)
+	{
+		return -1;
+	}
+
+	if (fileD != NULL)
+	{
+		memcpy(table, fileD, fd_capacity * sizeof(*table));
+	}
+	free(fileD);
+	fileD = table;
+	fd_capacity = capacity;
+	return 0;
+}
+
+// take the lowest free descriptor, or -1 when FS_OPEN_MAX_COUNT are in use
+static int fd_alloc(void)
+{
+	for (uint32_t i = 0; i < sizeof(fd_full) / sizeof(fd_full[0]); i++)
+	{
+		if (~fd_full[i] == 0)
+		{
+			continue;
+		}
+
+		uint32_t word = i * 64 + __builtin_ctzll(~fd_full[i]);
+		uint32_t fd = word * 64 + __builtin_ctzll(~fd_used[word]);
+		if (fd >= fd_capacity && fd_grow() < 0)
+		{
+			return -1;
+		}
+		fd_used[word] |= UINT64_C(1) << (fd % 64);
+		if (~fd_used[word] == 0)
+		{
+			fd_full[i] |= UINT64_C(1) << (word % 64);
+		}
+		return fd;
+	}
+	return -1;
+}
+
+static void fd_release(int fd)
+{
+	fd_used[fd / 64] &= ~(UINT64_C(1) << (fd % 64));
+	fd_full[fd / 64 / 64] &= ~(UINT64_C(1) << (fd / 64 % 64));
+}
+
+// directory entry of the file open as @fd, which must be valid
+static inline struct RootDirectory *fd_file(int fd, int dirty)
+{
+	return dir_entry(fileD[fd].slot, dirty);
+}
+
+// where the file open as @fd was last written, @fd being valid
+static inline struct ChainTail *fd_tail(int fd)
+{
+	return slot_tail(fileD[fd].slot);
+}
+
+// translate either superblock format into the mount geometry
+static int read_geometry(const struct Superblock *sb)
+{
+	if (memcmp(sb->signature, FS_SIGNATURE, sizeof(sb->signature)) == 0)
+	{
+		geometry.total_blocks = sb->total_blocks;
+		geometry.root_index = sb->root_index;
+		geometry.data_start = sb->data_start;
+		geometry.data_blocks = sb->data_blocks;
+		geometry.fat_blocks = sb->fat_blocks;
+		geometry.dir_blocks = 1;
+		geometry.ref_blocks = 0;
+		geometry.features = 0;
+		geometry.fat_width = 16;
+		geometry.block_size = BLOCK_SIZE;
+	}
+	else if (memcmp(sb->signature, FS_SIGNATURE_EXT, sizeof(sb->signature)) == 0)
+	{
+		geometry.total_blocks = sb->total_blocks32;
+		geometry.root_index = sb->root_index32;
+		geometry.data_start = sb->data_start32;
+		geometry.data_blocks = sb->data_blocks32;
+		geometry.fat_blocks = sb->fat_blocks32;
+		geometry.dir_blocks = sb->dir_blocks32 ? sb->dir_blocks32 : 1;
+		geometry.ref_blocks = sb->ref_blocks32;
+		geometry.features = sb->features;
+		geometry.fat_width = sb->fat_width;
+		geometry.block_size = sb->block_size32 ? sb->block_size32 : BLOCK_SIZE;
+	}
+	else
+	{
+		return -1;
+	}
+
+	// small files and mapped files lay out pack blocks, chunk maps and the
+	// refcount table for BLOCK_SIZE blocks only
+	if ((geometry.fat_width != 16 && geometry.fat_width != 32) || (geometry.features & ~FEATURES_KNOWN) ||
+		geometry.block_size < BLOCK_SIZE || geometry.block_size > BLOCK_SIZE_MAX ||
+		(geometry.block_size & (geometry.block_size - 1)) || (geometry.features && geometry.block_size != BLOCK_SIZE))
+	{
+		return -1;
+	}
+	geometry.chunk_blocks = geometry.features & FEATURE_COMPRESSION ? CHUNK_BLOCKS : 1;
+	geometry.block_shift = __builtin_ctz(geometry.block_size);
+	geometry.fat_shift = geometry.block_shift + 3 - __builtin_ctz(geometry.fat_width);
+	geometry.dir_entries = geometry.block_size / sizeof(struct RootDirectory);
+
+	// the FAT must be able to describe every data block, and the layout must
+	// match the disk it was found on
+	size_t fat_capacity = (size_t)geometry.fat_blocks << geometry.fat_shift;
+	size_t ref_capacity = (size_t)geometry.ref_blocks * REFS_SIZE;
+	if (geometry.data_blocks == 0 || fat_capacity < geometry.data_blocks ||
+		(refs_enabled() ? ref_capacity < geometry.data_blocks : ref_capacity != 0) ||
+		(size_t)geometry.root_index != 1 + (size_t)geometry.fat_blocks + geometry.ref_blocks ||
+		(size_t)geometry.data_start != (size_t)geometry.root_index + geometry.dir_blocks ||
+		(size_t)geometry.data_start + geometry.data_blocks != geometry.total_blocks ||
+		(uint64_t)geometry.total_blocks << geometry.block_shift != (uint64_t)block_disk_count() * block_disk_block_size())
+	{
+		return -1;
+	}
+	return 0;
+}
+
+static void free_metadata(void)
+{
+	block_buf_free(superblock, 1);
+	superblock = NULL;
+	pager_destroy(&fat_pager);
+	pager_destroy(&ref_pager);
+	pager_destroy(&dir_pager);
+	block_buf_free(pack_buf, 1);
+	pack_buf = NULL;
+	pack_cached = FAT_EOC;
+	chain_hint.first_block = FAT_EOC;
+	block_buf_free(map_buf, 1);
+	map_buf = NULL;
+	map_cached = FAT_EOC;
+	map_dirty = 0;
+	block_buf_free(chunk_buf, CHUNK_BLOCKS);
+	chunk_buf = NULL;
+	chunk_cached = FAT_EOC;
+	block_buf_free(lz_buf, CHUNK_BLOCKS);
+	lz_buf = NULL;
+	block_buf_free(verify_buf, CHUNK_BLOCKS);
+	verify_buf = NULL;
+	dedup_destroy(&dedup);
+	free(open_count);
+	open_count = NULL;
+	free(chain_tails);
+	chain_tails = NULL;
+	free(fileD);
+	fileD = NULL;
+	fd_capacity = 0;
+	while (mmap_buffers != NULL)
+	{
+		struct MmapBuffer *next = mmap_buffers->next;
+		free(mmap_buffers);
+		mmap_buffers = next;
+	}
+	image = NULL;
+}
+
+static uint32_t fat_cache_blocks(void)
+{
+	const char *env = getenv("FS_FAT_CACHE");
+	long blocks = env != NULL ? strtol(env, NULL, 0) : 0;
+
+	return blocks > 0 ? (uint32_t)blocks : FAT_CACHE_BLOCKS;
+}
+
+// worker threads issuing the parts of large reads and writes, none by default
+static unsigned int io_threads(void)
+{
+	const char *env = getenv("FS_IO_THREADS");
+	long threads = env != NULL ? strtol(env, NULL, 0) : 0;
+
+	return threads > 0 ? (unsigned int)threads : 0;
+}
+
+static enum durability durability_level(void)
+{
+	const char *env = getenv("FS_DURABILITY");
+
+	if (env != NULL && strcmp(env, "op") == 0)
+	{
+		return DURABILITY_OP;
+	}
+	if (env != NULL && strcmp(env, "sync") == 0)
+	{
+		return DURABILITY_SYNC;
+	}
+	return DURABILITY_NONE;
+}
+
+// write back all the metadata that was only changed in memory
+static int metadata_flush(void)
+{
+	// the FAT, refcount table and directory follow each other on disk, so
+	// their dirty blocks go out in one sorted batch
+	static struct writeback wb;
+	wb_init(&wb);
+	if (map_flush() < 0 || pager_writeback(&fat_pager, &wb) < 0 || pager_writeback(&ref_pager, &wb) < 0 ||
+		pager_writeback(&dir_pager, &wb) < 0 || wb_submit(&wb) < 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Group commit. A call that needs what it wrote to be durable takes the next
+ * commit number once its blocks are written, and then waits, without holding
+ * fs_lock, for a block_disk_sync() started after that. A single sync runs at
+ * a time: callers arriving meanwhile wait for it to end, and the next one
+ * then commits all of them at once.
+ */
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t commit_issued;	// last commit number taken
+static uint64_t commit_durable; // last commit number known to be durable
+static int commit_syncing;
+
+static uint64_t commit_take(void)
+{
+	pthread_mutex_lock(&commit_lock);
+	uint64_t seq = ++commit_issued;
+	pthread_mutex_unlock(&commit_lock);
+	return seq;
+}
+
+static int commit_wait(uint64_t seq)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&commit_lock);
+	while (commit_durable < seq)
+	{
+		if (commit_syncing)
+		{
+			pthread_cond_wait(&commit_cond, &commit_lock);
+			continue;
+		}
+
+		// lead a sync for everything committed so far
+		uint64_t target = commit_issued;
+		commit_syncing = 1;
+		pthread_mutex_unlock(&commit_lock);
+		int synced = block_disk_sync();
+		pthread_mutex_lock(&commit_lock);
+		commit_syncing = 0;
+		pthread_cond_broadcast(&commit_cond);
+		if (synced < 0)
+		{
+			ret = -1; // the others try again on their own
+			break;
+		}
+		commit_durable = target;
+	}
+	pthread_mutex_unlock(&commit_lock);
+	return ret;
+}
+
+// index the chunks of every mapped file
+static int dedup_build(void)
+{
+	if (dedup_init(&dedup) < 0 || chunk_buffers() < 0)
+	{
+		return -1;
+	}
+
+	for (uint32_t dir_block = 0; dir_block < geometry.dir_blocks; dir_block++)
+	{
+		struct RootDirectory *entries = pager_get(&dir_pager, dir_block, 0);
+		if (entries == NULL)
+		{
+			return -1;
+		}
+
+		for (uint32_t i = dir_first_entry(); i < geometry.dir_entries; i++)
+		{
+			if (entries[i].filename[0] == '\0' || file_is_small(&entries[i]) || !(entries[i].flags & ENTRY_MAPPED))
+			{
+				continue;
+			}
+			for (uint32_t block = file_first_block(&entries[i]); block != FAT_EOC; block = fat_get(block))
+			{
+				if (map_load(block, 0) < 0)
+				{
+					return -1;
+				}
+				for (uint32_t j = 0; j < MAP_ENTRIES; j++)
+				{
+					struct ChunkMap *map = &map_buf[j];
+					struct dedup_entry entry = {map->fingerprint, map->block, map->length, map->flags};
+					if (map->block != 0 && dedup_insert(&dedup, &entry) < 0)
+					{
+						return -1;
+					}
+				}
+			}
+		}
+	}
+	map_cached = FAT_EOC;
+	return 0;
+}
+
+// read the superblock into a new buffer, and the blocks following it into
+// @iov, which holds @nbufs buffers once this returns, the superblock first
+static int mount_read(struct iovec *iov, size_t *nbufs)
+{
+	// The metadata region can be no longer than this for the disk's size
+	// (a 32-bit FAT, a refcount table and a single directory block being the
+	// largest ones, longer directories being read on demand). When that is
+	// short, it is read whole with a single request; otherwise only the
+	// superblock is, and the tables get paged in as they are used.
+	size_t disk_blocks = block_disk_count();
+	size_t fat_entries = block_disk_block_size() / sizeof(uint32_t);
+	size_t window = 2 + (disk_blocks + fat_entries - 1) / fat_entries + (disk_blocks + REFS_SIZE - 1) / REFS_SIZE;
+	if (window > MOUNT_READ_MAX)
+	{
+		window = 1;
+	}
+	window = MIN(window, disk_blocks);
+
+	// Allocate memory for superblock and the blocks following it
+	superblock = block_buf_alloc(1);
+	if (superblock == NULL)
+	{
+		return -1;
+	}
+	iov[0].iov_base = superblock;
+	iov[0].iov_len = block_disk_block_size();
+	for (*nbufs = 1; *nbufs < window; (*nbufs)++)
+	{
+		if ((iov[*nbufs].iov_base = block_buf_alloc(1)) == NULL)
+		{
+			return -1;
+		}
+		iov[*nbufs].iov_len = block_disk_block_size();
+	}
+
+	return block_readv(0, iov, window);
+}
+
+// free the buffers of mount_read() still in @iov, the superblock included
+static void mount_release(struct iovec *iov, size_t *nbufs)
+{
+	while (*nbufs > 1)
+	{
+		block_buf_free(iov[--(*nbufs)].iov_base, 1);
+	}
+	*nbufs = 0;
+	block_buf_free(superblock, 1);
+	superblock = NULL;
+}
+
+static int do_fs_mount(const char *diskname)
+{
+	if (superblock != NULL)
+	{
+		return -1;
+	}
+
+	// Open the virtual disk file
+	if (block_disk_open(diskname) == -1)
+	{
+		return -1;
+	}
+
+	struct iovec iov[MOUNT_READ_MAX];
+	size_t nbufs = 0;
+
+	if (mount_read(iov, &nbufs) < 0 || read_geometry(superblock) < 0)
+	{
+		goto fail;
+	}
+	if (geometry.block_size != block_disk_block_size())
+	{
+		// the superblock was read in BLOCK_SIZE blocks: read the metadata
+		// again in the blocks of the image
+		mount_release(iov, &nbufs);
+		if (block_disk_set_block_size(geometry.block_size) < 0 || mount_read(iov, &nbufs) < 0 ||
+			read_geometry(superblock) < 0)
+		{
+			goto fail;
+		}
+	}
+
+	if (pager_init(&fat_pager, 1, geometry.fat_blocks, fat_cache_blocks()) < 0 ||
+		pager_init(&ref_pager, 1 + geometry.fat_blocks, geometry.ref_blocks, fat_cache_blocks()) < 0 ||
+		pager_init(&dir_pager, geometry.root_index, geometry.dir_blocks, geometry.dir_blocks) < 0)
+	{
+		goto fail;
+	}
+
+	// FAT and directory blocks that came with the superblock start out
+	// resident
+	for (size_t i = 1; i < nbufs; i++)
+	{
+		if (i <= geometry.fat_blocks && pager_install(&fat_pager, i - 1, iov[i].iov_base) == 0)
+		{
+			iov[i].iov_base = NULL;
+		}
+		else if (i > geometry.fat_blocks && i < geometry.root_index &&
+				 pager_install(&ref_pager, i - 1 - geometry.fat_blocks, iov[i].iov_base) == 0)
+		{
+			iov[i].iov_base = NULL;
+		}
+		else if (i >= geometry.root_index && pager_install(&dir_pager, i - geometry.root_index, iov[i].iov_base) == 0)
+		{
+			iov[i].iov_base = NULL;
+		}
+		block_buf_free(iov[i].iov_base, 1);
+	}
+	nbufs = 1;
+
+	if ((dedup_enabled() && dedup_build() < 0) || io_pool_start(io_threads()) < 0)
+	{
+		goto fail;
+	}
+
+	fat_hint = 1;
+	pack_hint = FAT_EOC;
+	durability = durability_level();
+	return 0;
+
+fail:
+	mount_release(iov, &nbufs);
+	free_metadata();
+	block_disk_close();
+	return -1;
+}
+
+// whenever fs_umount() is called, all meta-information and file data must have been written out to disk.
+static int do_fs_umount(void)
+{
+	if (superblock == NULL || numOpen > 0)
+	{
+		return -1;
+	}
+
+	// Syncs of calls still waiting on group commit finish before the disk
+	// is closed: with fs_lock held, the sync waited for here is the last one.
+	if (metadata_flush() < 0 || (durability != DURABILITY_NONE && commit_wait(commit_take()) < 0))
+	{
+		return -1;
+	}
+
+	io_pool_stop();
+	if (block_disk_close() == -1)
+	{
+		return -1;
+	}
+
+	free_metadata();
+	return 0;
+}
+
+static int do_fs_info(void)
+{
+	if (superblock == NULL)
+	{
+		return -1;
+	}
+
+	// count number of empty root directories
+	uint32_t Num_empty_entries = 0;
+	for (uint32_t block = 0; block < geometry.dir_blocks; block++)
+	{
+		struct RootDirectory *entries = pager_get(&dir_pager, block, 0);
+		if (entries == NULL)
+		{
+			return -1;
+		}
+		for (uint32_t i = dir_first_entry(); i < geometry.dir_entries; i++)
+		{
+			if (entries[i].filename[0] == '\0')
+			{
+				Num_empty_entries++;
+			}
+		}
+	}
+
+	uint32_t fat_free_numerator = fat_count_free();
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", geometry.total_blocks);
+	printf("fat_blk_count=%u\n", geometry.fat_blocks);
+	printf("rdir_blk=%u\n", geometry.root_index);
+	printf("data_blk=%u\n", geometry.data_start);
+	printf("data_blk_count=%u\n", geometry.data_blocks);
+	printf("fat_free_ratio=%u/%u\n", fat_free_numerator, geometry.data_blocks);
+	printf("rdir_free_ratio=%u/%u\n", Num_empty_entries, dir_capacity());
+
+	return 0;
+}
+
+static int do_fs_create(const char *filename)
+{
+	if (superblock == NULL || filename == NULL)
+	{
+		return -1;
+	}
+
+	size_t len = strnlen(filename, FS_FILENAME_LEN);
+	if (len == 0 || len == FS_FILENAME_LEN)
+	{
+		return -1;
+	}
+
+	// its already in the directory
+	if (find_file(filename, NULL) != NULL)
+	{
+		return -1;
+	}
+
+	struct DirSlot slot;
+	struct RootDirectory *file = dir_insert(filename, &slot);
+	if (file == NULL)
+	{
+		return -1; // directory full
+	}
+
+	// new files are empty, data blocks get allocated by fs_write()
+	file_set_first_block(file, FAT_EOC);
+	if (geometry.features & FEATURE_MAPPED)
+	{
+		file->flags = ENTRY_MAPPED;
+	}
+
+	return 0;
+}
+
+static int do_fs_delete(const char *filename)
+{
+	if (superblock == NULL || filename == NULL)
+	{
+		return -1;
+	}
+
+	struct DirSlot slot;
+	struct RootDirectory *file = find_file(filename, &slot); // search for the file in the root directory
+	if (file == NULL || is_open(slot))
+	{
+		return -1;
+	}
+
+	if (file_release(file) < 0)
+	{
+		return -1;
+	}
+
+	// Clear the entry for the file
+	dir_remove(slot);
+
+	return 0;
+}
+
+static int do_fs_clone(const char *src_filename, const char *dst_filename)
+{
+	if (superblock == NULL || src_filename == NULL || dst_filename == NULL)
+	{
+		return -1;
+	}
+
+	size_t len = strnlen(dst_filename, FS_FILENAME_LEN);
+	if (len == 0 || len == FS_FILENAME_LEN)
+	{
+		return -1;
+	}
+
+	struct RootDirectory *file = find_file(src_filename, NULL);
+	if (file == NULL || find_file(dst_filename, NULL) != NULL)
+	{
+		return -1;
+	}
+
+	struct DirSlot slot;
+	struct RootDirectory *clone = dir_insert(dst_filename, &slot);
+	if (clone == NULL)
+	{
+		return -1; // directory full
+	}
+
+	// inline content comes along with the entry, all the rest is redone
+	char filename[FS_FILENAME_LEN];
+	memcpy(filename, clone->filename, FS_FILENAME_LEN);
+	*clone = *file;
+	memcpy(clone->filename, filename, FS_FILENAME_LEN);
+
+	int ret = 0;
+	if (file->flags & ENTRY_PACKED)
+	{
+		char data[PACK_MAX];
+		memset(clone->inline_data, 0, INLINE_MAX);
+		file_set_first_block(clone, FAT_EOC);
+		clone->flags &= ENTRY_MAPPED;
+		clone->size = 0;
+		ret = small_load(file, data) < 0 || small_store(clone, data, file->size) < 0 ? -1 : 0;
+	}
+	else if (!(file->flags & ENTRY_INLINE))
+	{
+		file_set_first_block(clone, FAT_EOC);
+		if ((file->flags & ENTRY_MAPPED) && refs_enabled())
+		{
+			ret = map_clone(file, clone);
+		}
+		else
+		{
+			clone->size = 0;
+			ret = file_copy(file, clone);
+		}
+	}
+
+	if (ret < 0)
+	{
+		dir_remove(slot);
+		return -1;
+	}
+	return 0;
+}
+
+// the data block fs_ls() shows for @file
+static inline uint32_t file_listed_block(const struct RootDirectory *file)
+{
+	uint32_t first_block = file_data_block(file);
+	return first_block == FAT_EOC && geometry.fat_width == 16 ? FAT16_EOC : first_block;
+}
+
+static void dirent_fill(struct fs_dirent *dirent, const struct RootDirectory *file)
+{
+	memcpy(dirent->filename, file->filename, FS_FILENAME_LEN);
+	dirent->filename[FS_FILENAME_LEN - 1] = '\0';
+	dirent->size = file->size;
+	dirent->first_block = file_listed_block(file);
+}
+
+static int do_fs_ls(void)
+{
+	if (superblock == NULL)
+	{
+		return -1;
+	}
+
+	printf("FS Ls:\n");
+	for (uint32_t block = 0; block < geometry.dir_blocks; block++)
+	{
+		struct RootDirectory *entries = pager_get(&dir_pager, block, 0);
+		if (entries == NULL)
+		{
+			return -1;
+		}
+
+		for (uint32_t i = dir_first_entry(); i < geometry.dir_entries; i++)
+		{
+			// Check if an empty entry
+			if (entries[i].filename[0] != '\0')
+			{
+				printf("file: %.16s, ", entries[i].filename);
+				printf("size: %u, ", entries[i].size);
+				printf("data_blk: %u\n", file_listed_block(&entries[i]));
+			}
+		}
+	}
+	return 0;
+}
+
+// @cursor is the index of the next directory entry to look at, counting
+// dir_entries per directory block
+static int do_fs_readdir(size_t *cursor, struct fs_dirent *entries, size_t count)
+{
+	if (superblock == NULL || cursor == NULL || entries == NULL)
+	{
+		return -1;
+	}
+
+	size_t end = (size_t)geometry.dir_blocks * geometry.dir_entries;
+	struct RootDirectory *dir = NULL;
+	size_t filled = 0;
+	size_t pos;
+	for (pos = *cursor; pos < end && filled < count; pos++)
+	{
+		uint32_t index = pos % geometry.dir_entries;
+		if (dir == NULL || index == 0)
+		{
+			if ((dir = pager_get(&dir_pager, pos / geometry.dir_entries, 0)) == NULL)
+			{
+				return -1;
+			}
+		}
+		if (index >= dir_first_entry() && dir[index].filename[0] != '\0')
+		{
+			dirent_fill(&entries[filled++], &dir[index]);
+		}
+	}
+
+	*cursor = pos;
+	return filled;
+}
+
+static int do_fs_stat_names(const char **filenames, struct fs_dirent *entries, size_t count)
+{
+	if (superblock == NULL || filenames == NULL || entries == NULL)
+	{
+		return -1;
+	}
+
+	int found = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		const struct RootDirectory *file = filenames[i] != NULL ? find_file(filenames[i], NULL) : NULL;
+		if (file == NULL)
+		{
+			memset(&entries[i], 0, sizeof(entries[i]));
+			continue;
+		}
+		dirent_fill(&entries[i], file);
+		found++;
+	}
+	return found;
+}
+
+static int do_fs_open(const char *filename)
+{
+	// error checking
+	if (superblock == NULL || filename == NULL)
+	{
+		return -1;
+	}
+
+	// check if the filename equals the arguments passed
+	struct DirSlot slot;
+	if (find_file(filename, &slot) == NULL)
+	{
+		return -1;
+	}
+
+	size_t entries = (size_t)geometry.dir_blocks * geometry.dir_entries;
+	if ((open_count == NULL && (open_count = calloc(entries, sizeof(*open_count))) == NULL) ||
+		(chain_tails == NULL && (chain_tails = calloc(entries, sizeof(*chain_tails))) == NULL))
+	{
+		return -1;
+	}
+
+	int fd = fd_alloc();
+	if (fd < 0)
+	{
+		return -1;
+	}
+	numOpen++;
+	(*open_counter(slot))++;
+	fileD[fd].slot = slot;
+	fileD[fd].offset = 0;
+	return fd;
+}
+
+static int do_fs_close(int fd)
+{
+	// Check if the file descriptor is valid
+	if (!valid_fd(fd))
+	{
+		return -1;
+	}
+	// Reset values associated with the file descriptor
+	struct DirSlot slot = fileD[fd].slot;
+	if (--(*open_counter(slot)) == 0)
+	{
+		// the copy of the last block written only stays while the file is open
+		struct ChainTail *tail = slot_tail(slot);
+		block_buf_free(tail->data, 1);
+		tail->data = NULL;
+		tail->data_block = FAT_EOC;
+	}
+	fd_release(fd);
+	numOpen--;
+
+	return 0;
+}
+
+// get offset/size here
+static int do_fs_stat(int fd)
+{
+	// error check
+	if (!valid_fd(fd))
+	{
+		return -1;
+	}
+
+	struct RootDirectory *file = fd_file(fd, 0);
+	if (file == NULL)
+	{
+		// File not found
+		return -1;
+	}
+
+	// return its size
+	return file->size;
+}
+
+// actually change offset here
+static int do_fs_lseek(int fd, size_t offset)
+{
+	// Check if the file descriptor is valid
+	if (!valid_fd(fd))
+	{
+		return -1;
+	}
+
+	// past the end of the file is fine, a write there leaves a hole
+	if (offset > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	fileD[fd].offset = offset;
+	return 0;
+}
+
+// whether the content of @file goes to small file storage for now: it is
+// small already, or empty with no blocks reserved
+static inline int small_storage(const struct RootDirectory *file)
+{
+	return small_files() && (file_is_small(file) || (file->size == 0 && file_first_block(file) == FAT_EOC));
+}
+
+// move a small file holding @data to regular storage
+static int small_unpack(struct RootDirectory *file, struct ChainTail *tail, const char *data)
+{
+	// copy the current content to regular storage first, and only then let
+	// go of the small storage
+	struct RootDirectory old = *file;
+	memset(file->inline_data, 0, INLINE_MAX);
+	file_set_first_block(file, FAT_EOC);
+	file->flags &= ENTRY_MAPPED;
+	file->size = 0;
+	if (file_write(file, tail, 0, data, old.size) != (int)old.size)
+	{
+		file_release(file);
+		*file = old;
+		return -1;
+	}
+	return file_release(&old);
+}
+
+// write to a small or empty file, moving it to a FAT chain if it outgrows
+// small file storage
+static int small_write(struct RootDirectory *file, struct ChainTail *tail, size_t start_offset, const char *buf,
+					   size_t count)
+{
+	char data[PACK_MAX];
+	if (small_load(file, data) < 0)
+	{
+		return -1;
+	}
+
+	size_t end = start_offset + count;
+	if (end <= PACK_MAX)
+	{
+		if (start_offset > file->size)
+		{
+			memset(data + file->size, 0, start_offset - file->size);
+		}
+		memcpy(data + start_offset, buf, count);
+		if (small_store(file, data, end > file->size ? end : file->size) < 0)
+		{
+			return -1;
+		}
+		return count;
+	}
+
+	if (small_unpack(file, tail, data) < 0)
+	{
+		return 0; // disk full
+	}
+	return file_write(file, tail, start_offset, buf, count);
+}
+
+static int do_fs_write(int fd, void *buf, size_t count)
+{
+	if (!valid_fd(fd) || buf == NULL)
+	{
+		return -1;
+	}
+
+	// Retrieve the file associated with the fd, its entry is about to change
+	struct RootDirectory *file = fd_file(fd, 1);
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	size_t start_offset = fileD[fd].offset;
+	if (count > UINT32_MAX - start_offset)
+	{
+		count = UINT32_MAX - start_offset; // sizes are 32-bit on disk
+	}
+	if (count == 0)
+	{
+		return 0; // nothing written, so no hole either, whatever the storage
+	}
+
+	int bytes_written;
+	if (small_storage(file))
+	{
+		bytes_written = small_write(file, fd_tail(fd), start_offset, buf, count);
+	}
+	else
+	{
+		bytes_written = file_write(file, fd_tail(fd), start_offset, buf, count);
+	}
+
+	if (bytes_written > 0)
+	{
+		fileD[fd].offset += bytes_written;
+	}
+	return bytes_written;
+}
+
+static int do_fs_append(int fd, void *buf, size_t count)
+{
+	// checked here too, so that a call that fails leaves the offset alone
+	if (!valid_fd(fd) || buf == NULL)
+	{
+		return -1;
+	}
+
+	// the end of the file is taken as the offset under the same lock as the
+	// write, so concurrent appends never overlap
+	struct RootDirectory *file = fd_file(fd, 0);
+	if (file == NULL)
+	{
+		return -1;
+	}
+	fileD[fd].offset = file->size;
+	return do_fs_write(fd, buf, count);
+}
+
+// read @count bytes of @file from @start_offset on, within its size
+static int file_read(struct RootDirectory *file, size_t start_offset, char *buf, size_t count)
+{
+	if (file_is_small(file))
+	{
+		return small_read(file, start_offset, buf, count);
+	}
+	if (file->flags & ENTRY_MAPPED)
+	{
+		return map_read(file, start_offset, buf, count);
+	}
+	return chain_read(file_first_block(file), start_offset, buf, count);
+}
+
+static int do_fs_read(int fd, void *buf, size_t count)
+{
+	// error checking
+	if (!valid_fd(fd) || buf == NULL)
+	{
+		return -1;
+	}
+
+	// Retrieve the file associated with the file descriptor
+	struct RootDirectory *file = fd_file(fd, 0);
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	// Get the starting offset and size
+	size_t start_offset = fileD[fd].offset;
+	size_t file_size = file->size;
+
+	// doesn't exceed the file size
+	if (start_offset >= file_size)
+	{
+		return 0;
+	}
+	if (count > file_size - start_offset)
+	{
+		count = file_size - start_offset;
+	}
+
+	int bytes_read = file_read(file, start_offset, buf, count);
+	if (bytes_read > 0)
+	{
+		fileD[fd].offset += bytes_read;
+	}
+	return bytes_read;
+}
+
+// address in the disk mapping of the bytes [@offset, @offset + @len) of a
+// file stored as a FAT chain, or NULL unless they lie in consecutive blocks
+static const char *chain_map(struct RootDirectory *file, size_t offset, size_t len)
+{
+	size_t index = offset >> geometry.block_shift;
+	size_t last = (offset + len - 1) >> geometry.block_shift;
+	uint32_t first = chain_seek(file_first_block(file), index);
+	uint32_t block = first;
+
+	for (size_t i = index; i < last && block != FAT_EOC; i++)
+	{
+		uint32_t next = fat_get(block);
+		if (next != block + 1)
+		{
+			return NULL;
+		}
+		block = next;
+	}
+	if (block == FAT_EOC)
+	{
+		return NULL;
+	}
+
+	chain_remember(file_first_block(file), last, block);
+	return image + ((size_t)(geometry.data_start + first) << geometry.block_shift) +
+		   (offset & (geometry.block_size - 1));
+}
+
+static const void *do_fs_mmap(int fd, size_t offset, size_t len)
+{
+	if (!valid_fd(fd) || len == 0)
+	{
+		return NULL;
+	}
+
+	struct RootDirectory *file = fd_file(fd, 0);
+	if (file == NULL || offset > file->size || len > file->size - offset)
+	{
+		return NULL;
+	}
+
+	// packed files and single runs of a chain are read in place
+	if (image == NULL)
+	{
+		image = block_disk_map();
+	}
+	if (image != NULL && (file->flags & ENTRY_PACKED))
+	{
+		return image + ((size_t)(geometry.data_start + file_first_block(file)) << geometry.block_shift) +
+			   file->fragment * PACK_FRAGMENT + offset;
+	}
+	if (image != NULL && !(file->flags & (ENTRY_INLINE | ENTRY_MAPPED)))
+	{
+		const char *data = chain_map(file, offset, len);
+		if (data != NULL)
+		{
+			return data;
+		}
+	}
+
+	// everything else is copied once, straight into the buffer handed out
+	struct MmapBuffer *buffer = malloc(sizeof(*buffer) + len);
+	if (buffer == NULL)
+	{
+		return NULL;
+	}
+	int bytes_read = file_read(file, offset, buffer->data, len);
+	if (bytes_read < 0 || (size_t)bytes_read != len)
+	{
+		free(buffer);
+		return NULL;
+	}
+	buffer->next = mmap_buffers;
+	mmap_buffers = buffer;
+	return buffer->data;
+}
+
+static int do_fs_munmap(const void *addr)
+{
+	if (superblock == NULL || addr == NULL)
+	{
+		return -1;
+	}
+
+	const char *data = addr;
+	if (image != NULL && data >= image && data < image + ((size_t)geometry.total_blocks << geometry.block_shift))
+	{
+		return 0; // the disk mapping stays until fs_umount()
+	}
+
+	for (struct MmapBuffer **link = &mmap_buffers; *link != NULL; link = &(*link)->next)
+	{
+		if ((*link)->data == data)
+		{
+			struct MmapBuffer *buffer = *link;
+			*link = buffer->next;
+			free(buffer);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int do_fs_truncate(int fd, size_t size)
+{
+	if (!valid_fd(fd) || size > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	struct RootDirectory *file = fd_file(fd, 1);
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	if (small_storage(file))
+	{
+		char data[PACK_MAX];
+		if (small_load(file, data) < 0)
+		{
+			return -1;
+		}
+		if (size <= PACK_MAX)
+		{
+			if (size > file->size)
+			{
+				memset(data + file->size, 0, size - file->size);
+			}
+			return small_store(file, data, size);
+		}
+		if (small_unpack(file, fd_tail(fd), data) < 0)
+		{
+			return -1;
+		}
+	}
+
+	if (file->flags & ENTRY_MAPPED)
+	{
+		// growing only moves the end: the chunks past the old one are holes
+		if (size < file->size)
+		{
+			return map_truncate(file, size);
+		}
+		file->size = size;
+		return 0;
+	}
+
+	if (size > file->size)
+	{
+		// when the disk fills up, chain_write() cuts the chain back to the
+		// blocks it had and keeps the old size, so a failed grow does nothing
+		chain_write(file, fd_tail(fd), size, NULL, 0);
+		return file->size == size ? 0 : -1;
+	}
+	// blocks reserved past the end go too
+	chain_cut(file, size_blocks(size));
+	file->size = size;
+	return 0;
+}
+
+static int do_fs_fallocate(int fd, size_t size)
+{
+	if (!valid_fd(fd) || size > UINT32_MAX)
+	{
+		return -1;
+	}
+
+	struct RootDirectory *file = fd_file(fd, 1);
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	if (small_storage(file))
+	{
+		// small file storage has room for that much already
+		if (size <= PACK_MAX)
+		{
+			return 0;
+		}
+		char data[PACK_MAX];
+		if (small_load(file, data) < 0 || small_unpack(file, fd_tail(fd), data) < 0)
+		{
+			return -1;
+		}
+	}
+
+	if (size == 0)
+	{
+		return 0;
+	}
+	if (file->flags & ENTRY_MAPPED)
+	{
+		// chunks are only placed when written, so reserve the map for them
+		uint32_t map_blocks = 0;
+		for (uint32_t block = file_first_block(file); block != FAT_EOC; block = fat_get(block))
+		{
+			map_blocks++;
+		}
+		if (chunk_buffers() < 0 || map_entry(file, (size - 1) / chunk_size(), 1) == NULL)
+		{
+			map_dirty = 0;
+			map_cached = FAT_EOC;
+			chain_cut(file, map_blocks); // disk full, reserve nothing
+			return -1;
+		}
+		return map_flush();
+	}
+	return chain_reserve(file, size_blocks(size));
+}
+
+static int do_fs_sync(void)
+{
+	if (superblock == NULL)
+	{
+		return -1;
+	}
+	return metadata_flush();
+}
+
+/*
+ * Consistency check. fs_check() brings the whole FAT into memory, split into
+ * ranges of FAT blocks that threads read and scan at the same time, range
+ * checking every link and recording in two bitmaps the blocks linked to once
+ * and more than once (cross-linked chains). Files then walk their chains in
+ * that copy, marking the blocks they reach, and stop at the first block
+ * reached already, so that no block is walked twice and cycles end the walk.
+ * Another parallel pass counts the blocks in use that no file reached
+ * (leaked), and among them the chain heads that nothing links to (orphan
+ * chains).
+ */
+
+#define CHECK_THREADS_MAX 16
+#define CHECK_READ_BLOCKS 64 // FAT blocks read at once by each thread
+
+struct check
+{
+	uint32_t *next;		  // FAT, with FAT_EOC at either width
+	uint64_t *linked;	  // bitmap of the blocks some entry links to
+	uint64_t *cross;	  // bitmap of the blocks several entries link to
+	uint64_t *visited;	  // bitmap of the blocks reached from a file
+	uint64_t *packs;	  // bitmap of the pack blocks walked already
+	uint16_t *chunk_refs; // references found to each chunk, with a refcount table
+	uint32_t files;
+	uint32_t problems;
+};
+
+// FAT range of one thread, and what it found there
+struct check_range
+{
+	struct check *check;
+	uint32_t first_fat_block;
+	uint32_t end_fat_block;
+	uint32_t bad_links;
+	uint32_t used;
+	uint32_t leaked;
+	uint32_t orphans;
+	int error;
+};
+
+static inline int bit_test(const uint64_t *map, uint32_t bit)
+{
+	return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t *map, uint32_t bit)
+{
+	map[bit / 64] |= UINT64_C(1) << (bit % 64);
+}
+
+// set @bit, which other threads may be setting bits next to; returns its old value
+static inline int bit_set_atomic(uint64_t *map, uint32_t bit)
+{
+	uint64_t mask = UINT64_C(1) << (bit % 64);
+	return (__atomic_fetch_or(&map[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static void *check_load_fat(void *arg)
+{
+	struct check_range *range = arg;
+	struct check *check = range->check;
+	char *buf = block_buf_alloc(CHECK_READ_BLOCKS);
+	if (buf == NULL)
+	{
+		range->error = 1;
+		return NULL;
+	}
+
+	for (uint32_t fat_block = range->first_fat_block; fat_block < range->end_fat_block;
+		 fat_block += CHECK_READ_BLOCKS)
+	{
+		if ((uint64_t)fat_block * fat_block_entries() >= geometry.data_blocks)
+		{
+			// the FAT may be longer than needed, its tail maps no block
+			break;
+		}
+
+		uint32_t count = MIN(CHECK_READ_BLOCKS, range->end_fat_block - fat_block);
+		struct iovec iov = {buf, (size_t)count << geometry.block_shift};
+		if (block_readv(1 + fat_block, &iov, 1) < 0)
+		{
+			range->error = 1;
+			break;
+		}
+
+		uint32_t first = fat_block * fat_block_entries();
+		uint32_t end = MIN((uint64_t)(fat_block + count) * fat_block_entries(), geometry.data_blocks);
+
+		// entry 0 is reserved, and never part of a chain
+		uint32_t skip = first == 0;
+		const char *entries = buf + skip * (geometry.fat_width / 8);
+		uint32_t scanned = end - first - skip;
+		range->used += scanned - fatscan_count_zero(entries, scanned, geometry.fat_width);
+		range->bad_links += fatscan_count_out_of_range(entries, scanned, geometry.fat_width, geometry.data_blocks);
+
+		for (uint32_t index = first; index < end; index++)
+		{
+			uint32_t value;
+			if (geometry.fat_width == 32)
+			{
+				value = ((uint32_t *)buf)[index - first];
+			}
+			else
+			{
+				value = ((uint16_t *)buf)[index - first];
+				value = value == FAT16_EOC ? FAT_EOC : value;
+			}
+			check->next[index] = value;
+
+			if (index != 0 && value != 0 && value < geometry.data_blocks && bit_set_atomic(check->linked, value))
+			{
+				bit_set_atomic(check->cross, value);
+			}
+		}
+	}
+	block_buf_free(buf, CHECK_READ_BLOCKS);
+	return NULL;
+}
+
+static void *check_find_leaks(void *arg)
+{
+	struct check_range *range = arg;
+	struct check *check = range->check;
+	uint64_t first = MAX((uint64_t)range->first_fat_block * fat_block_entries(), 1);
+	uint32_t end = MIN((uint64_t)range->end_fat_block * fat_block_entries(), geometry.data_blocks);
+	if (first >= end)
+	{
+		return NULL;
+	}
+
+	for (uint32_t index = first; index < end; index++)
+	{
+		if (check->next[index] != 0 && !bit_test(check->visited, index))
+		{
+			range->leaked++;
+			if (!bit_test(check->linked, index))
+			{
+				range->orphans++;
+			}
+		}
+	}
+	return NULL;
+}
+
+// run @pass over every range, the first one in the calling thread; returns
+// -1 if a thread cannot be started or a range fails
+static int check_parallel(void *(*pass)(void *), struct check_range *ranges, uint32_t count)
+{
+	pthread_t threads[CHECK_THREADS_MAX];
+	uint32_t started = 1;
+	int ret = 0;
+
+	for (; started < count; started++)
+	{
+		if (pthread_create(&threads[started], NULL, pass, &ranges[started]) != 0)
+		{
+			ret = -1;
+			break;
+		}
+	}
+	pass(&ranges[0]);
+	for (uint32_t i = 1; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (ranges[i].error)
+		{
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void check_report(struct check *check, const struct RootDirectory *file, const char *fmt, ...)
+{
+	va_list args;
+
+	printf("fsck: file '%.16s': ", file->filename);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+	check->problems++;
+}
+
+// walk the chain starting at @block, marking its blocks visited; returns the
+// number of blocks walked
+static uint32_t check_chain(struct check *check, const struct RootDirectory *file, const char *what, uint32_t block)
+{
+	uint32_t length = 0;
+
+	while (block != FAT_EOC)
+	{
+		if (block == 0 || block >= geometry.data_blocks)
+		{
+			check_report(check, file, "%s links to invalid block %u", what, block);
+			break;
+		}
+		if (bit_test(check->visited, block))
+		{
+			check_report(check, file, "%s runs into block %u, already in use", what, block);
+			break;
+		}
+		bit_set(check->visited, block);
+		length++;
+		if (check->next[block] == 0)
+		{
+			check_report(check, file, "%s block %u is marked free", what, block);
+			break;
+		}
+		block = check->next[block];
+	}
+	return length;
+}
+
+static int check_packed(struct check *check, const struct RootDirectory *file)
+{
+	uint32_t block = file_first_block(file);
+	uint32_t fragments = pack_fragments(file->size);
+
+	if (file->size > PACK_MAX || file->fragment == 0 || file->fragment + fragments > PACK_FRAGMENTS)
+	{
+		check_report(check, file, "invalid fragments %u+%u", file->fragment, fragments);
+		return 0;
+	}
+	if (block == FAT_EOC || block == 0 || block >= geometry.data_blocks)
+	{
+		check_report(check, file, "invalid pack block %u", block);
+		return 0;
+	}
+	if (!bit_test(check->packs, block))
+	{
+		bit_set(check->packs, block);
+		if (check_chain(check, file, "pack", block) != 1 || check->next[block] != FAT_EOC)
+		{
+			check_report(check, file, "pack block %u is not a chain of its own", block);
+		}
+	}
+
+	struct PackHeader *pack = pack_load(block);
+	if (pack == NULL)
+	{
+		return -1;
+	}
+	if ((pack->used & pack_run(file->fragment, fragments)) != pack_run(file->fragment, fragments))
+	{
+		check_report(check, file, "fragments %u+%u are marked free in pack block %u", file->fragment, fragments,
+					 block);
+	}
+	return 0;
+}
+
+static void check_chunk(struct check *check, const struct RootDirectory *file, const struct ChunkMap *map)
+{
+	if (map->block >= geometry.data_blocks)
+	{
+		check_report(check, file, "chunk at invalid block %u", map->block);
+		return;
+	}
+	if (map->length == 0 || map->length > chunk_size())
+	{
+		check_report(check, file, "chunk at block %u has invalid length %u", map->block, map->length);
+		return;
+	}
+
+	// a shared chunk is only walked the first time it is found
+	if (check->chunk_refs != NULL && check->chunk_refs[map->block] != 0)
+	{
+		if (check->chunk_refs[map->block] < UINT16_MAX)
+		{
+			check->chunk_refs[map->block]++;
+		}
+		return;
+	}
+	if (check->chunk_refs != NULL)
+	{
+		check->chunk_refs[map->block] = 1;
+	}
+
+	uint32_t length = check_chain(check, file, "chunk", map->block);
+	if (length != chunk_blocks(map->length))
+	{
+		check_report(check, file, "chunk at block %u has %u blocks, %u expected", map->block, length,
+					 chunk_blocks(map->length));
+	}
+}
+
+static int check_mapped(struct check *check, const struct RootDirectory *file, struct ChunkMap *page)
+{
+	uint32_t block = file_first_block(file);
+	uint32_t map_blocks = check_chain(check, file, "chunk map", block);
+	uint32_t index = 0;
+
+	for (uint32_t i = 0; i < map_blocks; i++, block = check->next[block])
+	{
+		if (block_read(geometry.data_start + block, page) < 0)
+		{
+			return -1;
+		}
+		for (uint32_t j = 0; j < MAP_ENTRIES; j++, index++)
+		{
+			if (page[j].block == 0)
+			{
+				continue;
+			}
+			if ((uint64_t)index * chunk_size() >= file->size)
+			{
+				check_report(check, file, "chunk %u is past the end of the file", index);
+			}
+			check_chunk(check, file, &page[j]);
+		}
+	}
+	return 0;
+}
+
+static int check_file(struct check *check, const struct RootDirectory *file, struct ChunkMap *page)
+{
+	check->files++;
+	if (file->flags & ENTRY_INLINE)
+	{
+		if (file->size > INLINE_MAX)
+		{
+			check_report(check, file, "%u bytes do not fit inline", file->size);
+		}
+		return 0;
+	}
+	if (file->flags & ENTRY_PACKED)
+	{
+		return check_packed(check, file);
+	}
+	if (file->flags & ENTRY_MAPPED)
+	{
+		return check_mapped(check, file, page);
+	}
+
+	// fs_fallocate() may leave more blocks than the size needs, never fewer
+	uint32_t length = check_chain(check, file, "chain", file_first_block(file));
+	if ((uint64_t)length << geometry.block_shift < file->size)
+	{
+		check_report(check, file, "chain of %u blocks is too short for %u bytes", length, file->size);
+	}
+	return 0;
+}
+
+// compare the refcount table with the references found to each chunk
+static uint32_t check_refcounts(struct check *check)
+{
+	uint32_t problems = 0;
+
+	for (uint32_t block = 1; block < geometry.data_blocks; block++)
+	{
+		uint32_t found = check->chunk_refs[block];
+		uint16_t refs = ref_get(block);
+		if (found != UINT16_MAX && refs != (found != 0 ? found - 1 : 0))
+		{
+			printf("fsck: block %u: refcount %u, %u references found\n", block, refs, found);
+			problems++;
+		}
+	}
+	return problems;
+}
+
+static int do_fs_check(void)
+{
+	if (superblock == NULL || metadata_flush() < 0)
+	{
+		return -1;
+	}
+
+	size_t words = (geometry.data_blocks + 63) / 64;
+	struct check check = {
+		.next = malloc((size_t)geometry.data_blocks * sizeof(*check.next)),
+		.linked = calloc(words, sizeof(uint64_t)),
+		.cross = calloc(words, sizeof(uint64_t)),
+		.visited = calloc(words, sizeof(uint64_t)),
+		.packs = calloc(words, sizeof(uint64_t)),
+		.chunk_refs = refs_enabled() ? calloc(geometry.data_blocks, sizeof(uint16_t)) : NULL,
+	};
+	struct ChunkMap *page = block_buf_alloc(1);
+	int ret = -1;
+	if (check.next == NULL || check.linked == NULL || check.cross == NULL || check.visited == NULL ||
+		check.packs == NULL || (refs_enabled() && check.chunk_refs == NULL) || page == NULL)
+	{
+		goto out;
+	}
+
+	// one thread per CHECK_READ_BLOCKS FAT blocks at least, so small FATs
+	// are not split at all
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t threads = MIN((geometry.fat_blocks + CHECK_READ_BLOCKS - 1) / CHECK_READ_BLOCKS, CHECK_THREADS_MAX);
+	threads = MAX(MIN(threads, (uint32_t)MAX(cpus, 1)), 1);
+	struct check_range ranges[CHECK_THREADS_MAX];
+	for (uint32_t i = 0; i < threads; i++)
+	{
+		ranges[i] = (struct check_range){
+			.check = &check,
+			.first_fat_block = (uint64_t)geometry.fat_blocks * i / threads,
+			.end_fat_block = (uint64_t)geometry.fat_blocks * (i + 1) / threads,
+		};
+	}
+	if (check_parallel(check_load_fat, ranges, threads) < 0)
+	{
+		goto out;
+	}
+
+	for (uint32_t dir_block = 0; dir_block < geometry.dir_blocks; dir_block++)
+	{
+		struct RootDirectory *entries = pager_get(&dir_pager, dir_block, 0);
+		if (entries == NULL)
+		{
+			goto out;
+		}
+		for (uint32_t i = dir_first_entry(); i < geometry.dir_entries; i++)
+		{
+			if (entries[i].filename[0] != '\0' && check_file(&check, &entries[i], page) < 0)
+			{
+				goto out;
+			}
+		}
+	}
+	if (check.chunk_refs != NULL)
+	{
+		check.problems += check_refcounts(&check);
+	}
+
+	if (check_parallel(check_find_leaks, ranges, threads) < 0)
+	{
+		goto out;
+	}
+	uint32_t used = 0, leaked = 0, orphans = 0, bad_links = 0, cross_linked = 0;
+	for (uint32_t i = 0; i < threads; i++)
+	{
+		used += ranges[i].used;
+		leaked += ranges[i].leaked;
+		orphans += ranges[i].orphans;
+		bad_links += ranges[i].bad_links;
+	}
+	for (size_t i = 0; i < words; i++)
+	{
+		cross_linked += __builtin_popcountll(check.cross[i]);
+	}
+	check.problems += leaked + bad_links + cross_linked;
+
+	printf("fsck: files=%u used_blocks=%u leaked_blocks=%u orphan_chains=%u cross_linked=%u bad_links=%u "
+		   "problems=%u\n",
+		   check.files, used, leaked, orphans, cross_linked, bad_links, check.problems);
+	ret = MIN(check.problems, INT32_MAX);
+
+out:
+	free(check.next);
+	free(check.linked);
+	free(check.cross);
+	free(check.visited);
+	free(check.packs);
+	free(check.chunk_refs);
+	block_buf_free(page, 1);
+	return ret;
+}
+
+/*
+ * Public entry points: each one runs the matching do_fs_*() implementation
+ * under fs_lock, so that threads can share a mounted file system. It is also
+ * timed into its latency histogram when FS_LATENCY is set (lock wait
+ * included), and the block I/O it issues is tagged with its name when
+ * FS_TRACE is set.
+ */
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t op_begin(enum lat_op op)
+{
+	uint64_t start = lat_begin();
+
+	pthread_mutex_lock(&fs_lock);
+	trace_op = op;
+	return start;
+}
+
+static inline void op_end(enum lat_op op, uint64_t start)
+{
+	trace_op = TRACE_OP_NONE;
+	pthread_mutex_unlock(&fs_lock);
+	lat_end(op, start);
+}
+
+// op_end() for calls that change the file system, which write back their
+// metadata and commit it when the durability level is at least @level; returns
+// @ret, or -1 if that fails
+static inline int op_end_commit(enum lat_op op, uint64_t start, int ret, enum durability level)
+{
+	uint64_t seq = 0;
+	if (ret >= 0 && superblock != NULL && durability >= level)
+	{
+		if (metadata_flush() < 0)
+		{
+			ret = -1;
+		}
+		else if (durability != DURABILITY_NONE)
+		{
+			seq = commit_take();
+		}
+	}
+
+	trace_op = TRACE_OP_NONE;
+	pthread_mutex_unlock(&fs_lock);
+	if (seq != 0 && commit_wait(seq) < 0)
+	{
+		ret = -1;
+	}
+	lat_end(op, start);
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	uint64_t start = op_begin(LAT_FS_MOUNT);
+	int ret = do_fs_mount(diskname);
+	op_end(LAT_FS_MOUNT, start);
+	return ret;
+}
+
+int fs_umount(void)
+{
+	uint64_t start = op_begin(LAT_FS_UMOUNT);
+	int ret = do_fs_umount();
+	op_end(LAT_FS_UMOUNT, start);
+
+	if (lat_enabled)
+	{
+		lat_dump(stderr);
+	}
+	return ret;
+}
+
+int fs_info(void)
+{
+	uint64_t start = op_begin(LAT_FS_INFO);
+	int ret = do_fs_info();
+	op_end(LAT_FS_INFO, start);
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	uint64_t start = op_begin(LAT_FS_CREATE);
+	int ret = do_fs_create(filename);
+	return op_end_commit(LAT_FS_CREATE, start, ret, DURABILITY_OP);
+}
+
+int fs_delete(const char *filename)
+{
+	uint64_t start = op_begin(LAT_FS_DELETE);
+	int ret = do_fs_delete(filename);
+	return op_end_commit(LAT_FS_DELETE, start, ret, DURABILITY_OP);
+}
+
+int fs_clone(const char *src_filename, const char *dst_filename)
+{
+	uint64_t start = op_begin(LAT_FS_CLONE);
+	int ret = do_fs_clone(src_filename, dst_filename);
+	return op_end_commit(LAT_FS_CLONE, start, ret, DURABILITY_OP);
+}
+
+int fs_ls(void)
+{
+	uint64_t start = op_begin(LAT_FS_LS);
+	int ret = do_fs_ls();
+	op_end(LAT_FS_LS, start);
+	return ret;
+}
+
+int fs_readdir(size_t *cursor, struct fs_dirent *entries, size_t count)
+{
+	uint64_t start = op_begin(LAT_FS_READDIR);
+	int ret = do_fs_readdir(cursor, entries, count);
+	op_end(LAT_FS_READDIR, start);
+	return ret;
+}
+
+int fs_stat_names(const char **filenames, struct fs_dirent *entries, size_t count)
+{
+	uint64_t start = op_begin(LAT_FS_STAT_NAMES);
+	int ret = do_fs_stat_names(filenames, entries, count);
+	op_end(LAT_FS_STAT_NAMES, start);
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	uint64_t start = op_begin(LAT_FS_OPEN);
+	int ret = do_fs_open(filename);
+	op_end(LAT_FS_OPEN, start);
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	uint64_t start = op_begin(LAT_FS_CLOSE);
+	int ret = do_fs_close(fd);
+	op_end(LAT_FS_CLOSE, start);
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	uint64_t start = op_begin(LAT_FS_STAT);
+	int ret = do_fs_stat(fd);
+	op_end(LAT_FS_STAT, start);
+	return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	uint64_t start = op_begin(LAT_FS_LSEEK);
+	int ret = do_fs_lseek(fd, offset);
+	op_end(LAT_FS_LSEEK, start);
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	uint64_t start = op_begin(LAT_FS_WRITE);
+	int ret = do_fs_write(fd, buf, count);
+	return op_end_commit(LAT_FS_WRITE, start, ret, DURABILITY_OP);
+}
+
+int fs_append(int fd, void *buf, size_t count)
+{
+	uint64_t start = op_begin(LAT_FS_APPEND);
+	int ret = do_fs_append(fd, buf, count);
+	return op_end_commit(LAT_FS_APPEND, start, ret, DURABILITY_OP);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	uint64_t start = op_begin(LAT_FS_READ);
+	int ret = do_fs_read(fd, buf, count);
+	op_end(LAT_FS_READ, start);
+	return ret;
+}
+
+const void *fs_mmap(int fd, size_t offset, size_t len)
+{
+	uint64_t start = op_begin(LAT_FS_MMAP);
+	const void *ret = do_fs_mmap(fd, offset, len);
+	op_end(LAT_FS_MMAP, start);
+	return ret;
+}
+
+int fs_munmap(const void *addr)
+{
+	uint64_t start = op_begin(LAT_FS_MUNMAP);
+	int ret = do_fs_munmap(addr);
+	op_end(LAT_FS_MUNMAP, start);
+	return ret;
+}
+
+int fs_truncate(int fd, size_t size)
+{
+	uint64_t start = op_begin(LAT_FS_TRUNCATE);
+	int ret = do_fs_truncate(fd, size);
+	return op_end_commit(LAT_FS_TRUNCATE, start, ret, DURABILITY_OP);
+}
+
+int fs_fallocate(int fd, size_t size)
+{
+	uint64_t start = op_begin(LAT_FS_FALLOCATE);
+	int ret = do_fs_fallocate(fd, size);
+	return op_end_commit(LAT_FS_FALLOCATE, start, ret, DURABILITY_OP);
+}
+
+int fs_sync(void)
+{
+	uint64_t start = op_begin(LAT_FS_SYNC);
+	int ret = do_fs_sync();
+	return op_end_commit(LAT_FS_SYNC, start, ret, DURABILITY_NONE);
+}
+
+int fs_check(void)
+{
+	uint64_t start = op_begin(LAT_FS_CHECK);
+	int ret = do_fs_check();
+	op_end(LAT_FS_CHECK, start);
+	return ret;
+}
+
+int fs_latency_dump(void)
+{
+	if (!lat_enabled)
+	{
+		return -1;
+	}
+
+	lat_dump(stderr);
+	return 0;
+}
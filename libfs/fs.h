@@ -6,15 +6,27 @@
  */
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * All the functions below can be called concurrently from several threads
+ * sharing the mounted file system; calls are serialized internally.
+ */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/**
+ * Maximum number of files in a single-block root directory. Extended images
+ * with a multi-block (hashed) root directory hold 127 files per block.
+ */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+/**
+ * Maximum number of open files. The descriptor table grows as files are
+ * opened, so only the descriptors used take memory.
+ */
+#define FS_OPEN_MAX_COUNT 65536
 
 /**
  * fs_mount - Mount a file system
@@ -60,7 +72,7 @@ int fs_info(void);
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the root directory is full. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -77,6 +89,23 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src_filename: Name of the file to clone
+ * @dst_filename: Name of the new file
+ *
+ * Create a new file named @dst_filename with the same content as the file
+ * named @src_filename. On images made with clone or deduplication support
+ * (fs_make -f clones or -f dedup), the two files share their data blocks,
+ * which only get copied when one of the files is written to, so that cloning
+ * a large file writes little. On other images, the content is copied.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named
+ * @src_filename, or if @dst_filename is invalid or already exists, or if the
+ * root directory or the disk is full. 0 otherwise.
+ */
+int fs_clone(const char *src_filename, const char *dst_filename);
+
 /**
  * fs_ls - List files on file system
  *
@@ -86,6 +115,45 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** File listed by fs_readdir() or looked up by fs_stat_names() */
+struct fs_dirent {
+	char filename[FS_FILENAME_LEN];
+	uint32_t size;
+	uint32_t first_block; /* data_blk, as fs_ls() prints it */
+};
+
+/**
+ * fs_readdir - List files on file system, a batch at a time
+ * @cursor: Position in the root directory, 0 to start from the beginning
+ * @entries: Array of @count entries to fill
+ * @count: Number of entries
+ *
+ * Fill @entries with the files of the root directory found from @cursor on,
+ * up to @count of them, and move @cursor past the last one. The files are the
+ * ones fs_ls() prints, in the same order; calling fs_readdir() until it
+ * returns 0 lists each file present all along exactly once.
+ *
+ * Return: -1 if no FS is currently mounted, or if @cursor or @entries is NULL,
+ * or if the directory cannot be read. Otherwise return the number of entries
+ * filled, 0 once the end of the directory is reached.
+ */
+int fs_readdir(size_t *cursor, struct fs_dirent *entries, size_t count);
+
+/**
+ * fs_stat_names - Look up several files by name
+ * @filenames: Array of @count file names
+ * @entries: Array of @count entries to fill
+ * @count: Number of files
+ *
+ * Fill entry i of @entries with the size and first block of file
+ * @filenames[i], without opening it. The entry of a file that does not exist
+ * has an empty file name.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filenames or @entries is
+ * NULL. Otherwise return the number of files found.
+ */
+int fs_stat_names(const char **filenames, struct fs_dirent *entries, size_t count);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -96,7 +164,7 @@ int fs_ls(void);
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously. The lowest file descriptor not in use is returned.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
@@ -137,9 +205,14 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset can be past the end of the file. A write there leaves a hole
+ * between the previous end of the file and the offset, which reads back as
+ * zeros. On file systems with chunk-mapped files, holes take no data blocks;
+ * otherwise they are filled with zeros on disk.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than the largest file size (4 GiB - 1). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -165,6 +238,27 @@ int fs_lseek(int fd, size_t offset);
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_append - Write at the end of a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Like fs_write(), but the data goes at the end of the file, whatever the file
+ * offset of @fd. Taking the end of the file and writing there is one step:
+ * appends from several threads, on the same descriptor or not, each land in
+ * their own range, one after the other. The file offset of @fd is then set to
+ * the end of the data written.
+ *
+ * The position of the last block of the file is remembered from one write to
+ * the next, so appending to a large file does not walk its whole FAT chain.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually written.
+ */
+int fs_append(int fd, void *buf, size_t count);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -180,10 +274,140 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * When the environment variable FS_IO_THREADS is set to a number of threads
+ * when the file system is mounted, large reads and writes of files stored
+ * as block chains are split into runs of consecutive blocks, issued
+ * concurrently by these threads, and the call returns once all of them are
+ * done. By default, they are issued one after the other.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_mmap - Map part of a file in memory
+ * @fd: File descriptor
+ * @offset: Offset of the first byte to map
+ * @len: Number of bytes to map
+ *
+ * Make the @len bytes of the file referenced by file descriptor @fd found at
+ * @offset readable in place, without moving the file offset of @fd. When they
+ * are stored in consecutive data blocks, the returned address points straight
+ * into a read-only mapping of the virtual disk file, and nothing is copied.
+ * Otherwise, they are read into a buffer allocated for them.
+ *
+ * The bytes stay readable until fs_munmap() or fs_umount(), even once @fd is
+ * closed, but only reflect later changes to the file, if at all, as long as
+ * its blocks are not freed: the file must not be truncated or deleted while
+ * they are in use.
+ *
+ * Return: NULL if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @len is 0, or if the
+ * range goes past the end of the file, or if it cannot be read. Otherwise the
+ * address of the first byte.
+ */
+const void *fs_mmap(int fd, size_t offset, size_t len);
+
+/**
+ * fs_munmap - Release a range mapped by fs_mmap()
+ * @addr: Address returned by fs_mmap()
+ *
+ * Free the buffer holding the range when it had to be copied. Ranges read in
+ * place in the disk mapping need nothing released, the mapping lasting until
+ * fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, or if @addr is neither in the disk
+ * mapping nor a copy made by fs_mmap() and not released yet. 0 otherwise.
+ */
+int fs_munmap(const void *addr);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @size: New size of the file
+ *
+ * Shrink the file referenced by file descriptor @fd to @size bytes, freeing
+ * the blocks past the new end (blocks reserved with fs_fallocate() included),
+ * or grow it to @size bytes, the new bytes reading as zeros. The file offset
+ * of @fd is left unchanged, even when past the new end.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @size is larger than
+ * the largest file size (4 GiB - 1), or if the disk runs out of space while
+ * growing the file. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t size);
+
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @size: Size to reserve space for
+ *
+ * Allocate in advance the data blocks that the file referenced by file
+ * descriptor @fd needs to reach @size bytes, as one contiguous run of blocks
+ * when the disk has one free that is long enough. The size of the file does
+ * not change, and writes up to @size bytes then use the reserved blocks. On
+ * extended images storing files as chunk maps, where the data blocks of a
+ * chunk are only placed when it is written, the chunk map is reserved instead.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @size is larger than
+ * the largest file size (4 GiB - 1), or if there is not enough free space (in
+ * which case nothing is reserved). 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
+/**
+ * fs_sync - Write back the file system
+ *
+ * Write all the metadata changed in memory since it was last written back
+ * (the FAT, the root directory...) to the virtual disk file. How far this goes
+ * depends on the durability level, set by the environment variable
+ * FS_DURABILITY when the file system is mounted:
+ *
+ * - "none" (default): the data is left to the host to write out.
+ * - "sync": fs_sync() and fs_umount() also wait until everything written is
+ *   on stable storage.
+ * - "op": in addition, every call that changes the file system (fs_create(),
+ *   fs_delete(), fs_clone(), fs_write(), fs_append(), fs_truncate(),
+ *   fs_fallocate()) only returns once its changes are on stable storage.
+ *   Concurrent calls share one synchronization of the disk rather than
+ *   paying one each.
+ *
+ * Return: -1 if no FS is currently mounted, or if the data cannot be written
+ * or synchronized. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_check - Check the consistency of the file system
+ *
+ * Verify that the FAT chain of every file in the root directory ends in
+ * end-of-chain and is as long as the file size requires, and look for blocks
+ * in use by several files (cross-linked), blocks in use by none (leaked, with
+ * the chains nothing links to counted as orphan chains), and links out of
+ * range. Each problem found is printed, followed by a summary line. The
+ * whole FAT is held in memory during the check, and is read by several
+ * threads at once when it is large. Nothing is repaired.
+ *
+ * Return: -1 if no FS is currently mounted, or if the check cannot be
+ * completed. Otherwise the number of problems found, 0 for a consistent file
+ * system.
+ */
+int fs_check(void);
+
+/**
+ * fs_latency_dump - Print latency histograms
+ *
+ * Print the count and tail latencies (p50 to p99.9 and max, in nanoseconds) of
+ * every public fs_*() call and of block_read()/block_write() on stderr.
+ * Recording is enabled by setting the environment variable FS_LATENCY, in
+ * which case the histograms are also printed by every fs_umount().
+ *
+ * Return: -1 if latency recording is not enabled. 0 otherwise.
+ */
+int fs_latency_dump(void);
+
 #endif /* _FS_H */
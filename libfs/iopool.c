@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "iopool.h"
+#include "trace.h"
+
+/*
+ * The batch being submitted is shared with the workers, which take its
+ * extents one at a time, as does the submitting thread, until none are left.
+ * Submissions are serialized, one batch being in flight at a time.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work; // a batch was submitted, or the pool is stopping
+	pthread_cond_t done; // the last extent of the batch completed
+	pthread_mutex_t submit;
+	pthread_t threads[IO_THREADS_MAX];
+	unsigned int count;
+	int stopping;
+	struct io_batch *batch;
+	int write;
+	uint8_t trace_op; // of the submitter, for the I/O the workers issue
+	uint32_t next;	  // next extent to take
+	uint32_t pending; // extents not completed yet
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.submit = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void io_batch_init(struct io_batch *batch)
+{
+	batch->count = 0;
+	batch->blocks = 0;
+}
+
+int io_batch_add(struct io_batch *batch, size_t block, char *buf)
+{
+	struct io_extent *last = batch->count > 0 ? &batch->ext[batch->count - 1] : NULL;
+
+	if (last != NULL && last->count < IO_EXTENT_MAX && block == last->block + last->count &&
+		buf == last->buf + (size_t)last->count * block_disk_block_size())
+	{
+		last->count++;
+	}
+	else
+	{
+		batch->ext[batch->count++] = (struct io_extent){.block = block, .count = 1, .buf = buf};
+	}
+	batch->blocks++;
+
+	// the next transfer may need an extent of its own, and there is none left
+	return batch->count == IO_BATCH_MAX;
+}
+
+static void run_extent(struct io_extent *ext, int write)
+{
+	struct iovec iov = {ext->buf, (size_t)ext->count * block_disk_block_size()};
+
+	ext->error = (write ? block_writev(ext->block, &iov, 1) : block_readv(ext->block, &iov, 1)) < 0;
+}
+
+// take and run extents of the current batch until none are left; called
+// with pool.lock held
+static void run_extents(void)
+{
+	while (pool.batch != NULL && pool.next < pool.batch->count)
+	{
+		struct io_extent *ext = &pool.batch->ext[pool.next++];
+		int write = pool.write;
+
+		pthread_mutex_unlock(&pool.lock);
+		run_extent(ext, write);
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.pending == 0)
+		{
+			pthread_cond_signal(&pool.done);
+		}
+	}
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.stopping)
+	{
+		if (pool.batch == NULL || pool.next == pool.batch->count)
+		{
+			pthread_cond_wait(&pool.work, &pool.lock);
+			continue;
+		}
+		trace_op = pool.trace_op;
+		run_extents();
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+uint32_t io_batch_submit(struct io_batch *batch, int write)
+{
+	if (pool.count > 0 && batch->blocks >= IO_PARALLEL_MIN && batch->count > 1)
+	{
+		pthread_mutex_lock(&pool.submit);
+		pthread_mutex_lock(&pool.lock);
+		pool.batch = batch;
+		pool.write = write;
+		pool.trace_op = trace_op;
+		pool.next = 0;
+		pool.pending = batch->count;
+		pthread_cond_broadcast(&pool.work);
+
+		run_extents();
+		while (pool.pending > 0)
+		{
+			pthread_cond_wait(&pool.done, &pool.lock);
+		}
+		pool.batch = NULL;
+		pthread_mutex_unlock(&pool.lock);
+		pthread_mutex_unlock(&pool.submit);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < batch->count; i++)
+		{
+			run_extent(&batch->ext[i], write);
+			if (batch->ext[i].error)
+			{
+				batch->count = i + 1;
+				break;
+			}
+		}
+	}
+
+	uint32_t blocks = 0;
+	for (uint32_t i = 0; i < batch->count && !batch->ext[i].error; i++)
+	{
+		blocks += batch->ext[i].count;
+	}
+	io_batch_init(batch);
+	return blocks;
+}
+
+int io_pool_start(unsigned int threads)
+{
+	if (threads > IO_THREADS_MAX)
+	{
+		threads = IO_THREADS_MAX;
+	}
+
+	pool.stopping = 0;
+	for (pool.count = 0; pool.count < threads; pool.count++)
+	{
+		if (pthread_create(&pool.threads[pool.count], NULL, worker, NULL) != 0)
+		{
+			io_pool_stop();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void io_pool_stop(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.stopping = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (unsigned int i = 0; i < pool.count; i++)
+	{
+		pthread_join(pool.threads[i], NULL);
+	}
+	pool.count = 0;
+}
@@ -0,0 +1,81 @@
+#ifndef _IOPOOL_H
+#define _IOPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Parallel block I/O
+ *
+ * A batch collects the whole-block transfers of one request as extents, runs
+ * of consecutive disk blocks mapping to consecutive memory, of at most
+ * IO_EXTENT_MAX blocks each. Submitting a batch issues one block_readv() or
+ * block_writev() per extent. With a worker pool started, the extents of a
+ * batch of at least IO_PARALLEL_MIN blocks are spread over the workers and
+ * the submitting thread, so that a single large request keeps several I/Os in
+ * flight; otherwise they are issued in order by the submitting thread.
+ */
+
+#define IO_BATCH_MAX 256
+#define IO_EXTENT_MAX 64
+#define IO_PARALLEL_MIN 128
+#define IO_THREADS_MAX 64
+
+struct io_extent
+{
+	size_t block; // first disk block
+	uint32_t count;
+	int error;
+	char *buf;
+};
+
+struct io_batch
+{
+	struct io_extent ext[IO_BATCH_MAX];
+	uint32_t count;
+	uint32_t blocks;
+};
+
+/**
+ * io_batch_init - Set up an empty batch
+ * @batch: Batch
+ */
+void io_batch_init(struct io_batch *batch);
+
+/**
+ * io_batch_add - Queue a block transfer
+ * @batch: Batch, not full
+ * @block: Disk block
+ * @buf: Block of memory to transfer to or from, which must stay valid until
+ * the batch is submitted
+ *
+ * Return: 1 if the batch is full and must be submitted before the next
+ * transfer is added. 0 otherwise.
+ */
+int io_batch_add(struct io_batch *batch, size_t block, char *buf);
+
+/**
+ * io_batch_submit - Issue the transfers of a batch
+ * @batch: Batch, empty once this returns
+ * @write: Whether to write the blocks rather than read them
+ *
+ * Return: number of blocks transferred, in the order they were added, before
+ * the first one that failed. All of them if none failed.
+ */
+uint32_t io_batch_submit(struct io_batch *batch, int write);
+
+/**
+ * io_pool_start - Start the worker pool
+ * @threads: Number of worker threads, at most IO_THREADS_MAX
+ *
+ * Return: -1 if the threads cannot be started. 0 otherwise, including when
+ * @threads is 0, in which case batches are always issued in order.
+ */
+int io_pool_start(unsigned int threads);
+
+/**
+ * io_pool_stop - Stop the worker pool, and wait for its threads to exit
+ */
+void io_pool_stop(void);
+
+#endif /* _IOPOOL_H */
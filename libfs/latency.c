@@ -0,0 +1,157 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+
+// 2^SUB_BITS linear sub-buckets per power of two
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define NUM_BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+static const char *lat_names[LAT_OP_COUNT] = {
+	[LAT_FS_MOUNT] = "fs_mount",
+	[LAT_FS_UMOUNT] = "fs_umount",
+	[LAT_FS_INFO] = "fs_info",
+	[LAT_FS_CREATE] = "fs_create",
+	[LAT_FS_DELETE] = "fs_delete",
+	[LAT_FS_LS] = "fs_ls",
+	[LAT_FS_OPEN] = "fs_open",
+	[LAT_FS_CLOSE] = "fs_close",
+	[LAT_FS_STAT] = "fs_stat",
+	[LAT_FS_LSEEK] = "fs_lseek",
+	[LAT_FS_WRITE] = "fs_write",
+	[LAT_FS_READ] = "fs_read",
+	[LAT_FS_TRUNCATE] = "fs_truncate",
+	[LAT_FS_FALLOCATE] = "fs_fallocate",
+	[LAT_FS_CLONE] = "fs_clone",
+	[LAT_FS_SYNC] = "fs_sync",
+	[LAT_FS_CHECK] = "fs_check",
+	[LAT_FS_APPEND] = "fs_append",
+	[LAT_FS_READDIR] = "fs_readdir",
+	[LAT_FS_STAT_NAMES] = "fs_stat_names",
+	[LAT_FS_MMAP] = "fs_mmap",
+	[LAT_FS_MUNMAP] = "fs_munmap",
+	[LAT_BLOCK_READ] = "block_read",
+	[LAT_BLOCK_WRITE] = "block_write",
+	[LAT_BLOCK_READV] = "block_readv",
+	[LAT_BLOCK_WRITEV] = "block_writev",
+};
+
+int lat_enabled;
+
+static uint64_t lat_buckets[LAT_OP_COUNT][NUM_BUCKETS];
+static uint64_t lat_max[LAT_OP_COUNT];
+
+__attribute__((constructor)) static void lat_init(void)
+{
+	const char *env = getenv("FS_LATENCY");
+
+	lat_enabled = env != NULL && *env != '\0' && strcmp(env, "0") != 0;
+}
+
+static inline unsigned int bucket_index(uint64_t ns)
+{
+	if (ns < SUB_COUNT)
+	{
+		return ns;
+	}
+
+	// position of the most significant bit selects the octave, the next
+	// SUB_BITS bits select the linear sub-bucket inside of it
+	unsigned int msb = 63 - __builtin_clzll(ns);
+	unsigned int sub = (ns >> (msb - SUB_BITS)) & (SUB_COUNT - 1);
+	return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+static uint64_t bucket_upper(unsigned int index)
+{
+	if (index < SUB_COUNT)
+	{
+		return index;
+	}
+
+	unsigned int shift = index / SUB_COUNT - 1;
+	uint64_t low = (uint64_t)(SUB_COUNT + index % SUB_COUNT) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+void lat_record(enum lat_op op, uint64_t ns)
+{
+	__atomic_fetch_add(&lat_buckets[op][bucket_index(ns)], 1, __ATOMIC_RELAXED);
+
+	uint64_t cur = __atomic_load_n(&lat_max[op], __ATOMIC_RELAXED);
+	while (ns > cur && !__atomic_compare_exchange_n(&lat_max[op], &cur, ns, 1,
+													 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+const char *lat_op_name(unsigned int op)
+{
+	if (op >= LAT_OP_COUNT)
+	{
+		return NULL;
+	}
+	return lat_names[op];
+}
+
+// smallest bucket bound such that at least @permille/1000 of samples are below it
+static uint64_t percentile(const uint64_t *buckets, uint64_t total, uint64_t max, unsigned int permille)
+{
+	uint64_t target = (total * permille + 999) / 1000;
+	uint64_t seen = 0;
+
+	for (unsigned int i = 0; i < NUM_BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen >= target)
+		{
+			uint64_t upper = bucket_upper(i);
+			return upper < max ? upper : max;
+		}
+	}
+	return max;
+}
+
+void lat_dump(FILE *out)
+{
+	// the name column fits the longest operation name
+	int width = 0;
+	for (int op = 0; op < LAT_OP_COUNT; op++)
+	{
+		if ((int)strlen(lat_names[op]) > width)
+		{
+			width = strlen(lat_names[op]);
+		}
+	}
+
+	fprintf(out, "FS Latency (ns):\n");
+	fprintf(out, "%-*s %10s %10s %10s %10s %10s %10s\n", width,
+			"op", "count", "p50", "p90", "p99", "p99.9", "max");
+
+	for (int op = 0; op < LAT_OP_COUNT; op++)
+	{
+		uint64_t buckets[NUM_BUCKETS];
+		uint64_t total = 0;
+
+		for (unsigned int i = 0; i < NUM_BUCKETS; i++)
+		{
+			buckets[i] = __atomic_load_n(&lat_buckets[op][i], __ATOMIC_RELAXED);
+			total += buckets[i];
+		}
+		if (total == 0)
+		{
+			continue;
+		}
+
+		uint64_t max = __atomic_load_n(&lat_max[op], __ATOMIC_RELAXED);
+		fprintf(out, "%-*s %10" PRIu64, width, lat_names[op], total);
+		fprintf(out, " %10" PRIu64, percentile(buckets, total, max, 500));
+		fprintf(out, " %10" PRIu64, percentile(buckets, total, max, 900));
+		fprintf(out, " %10" PRIu64, percentile(buckets, total, max, 990));
+		fprintf(out, " %10" PRIu64, percentile(buckets, total, max, 999));
+		fprintf(out, " %10" PRIu64 "\n", max);
+	}
+}
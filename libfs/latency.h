@@ -0,0 +1,100 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Per-operation latency histograms
+ *
+ * Recording is off unless the environment variable FS_LATENCY is set to a
+ * non-zero value when the library is loaded. When enabled, every public fs_*
+ * call and every block I/O call of the disk layer records its duration into a
+ * log-linear histogram (16 linear sub-buckets per power of two, so any
+ * reported percentile is within ~6% of the true value).
+ */
+
+enum lat_op
+{
+	LAT_FS_MOUNT,
+	LAT_FS_UMOUNT,
+	LAT_FS_INFO,
+	LAT_FS_CREATE,
+	LAT_FS_DELETE,
+	LAT_FS_LS,
+	LAT_FS_OPEN,
+	LAT_FS_CLOSE,
+	LAT_FS_STAT,
+	LAT_FS_LSEEK,
+	LAT_FS_WRITE,
+	LAT_FS_READ,
+	LAT_FS_TRUNCATE,
+	LAT_FS_FALLOCATE,
+	LAT_FS_CLONE,
+	LAT_FS_SYNC,
+	LAT_FS_CHECK,
+	LAT_FS_APPEND,
+	LAT_FS_READDIR,
+	LAT_FS_STAT_NAMES,
+	LAT_FS_MMAP,
+	LAT_FS_MUNMAP,
+	LAT_BLOCK_READ,
+	LAT_BLOCK_WRITE,
+	LAT_BLOCK_READV,
+	LAT_BLOCK_WRITEV,
+	LAT_OP_COUNT
+};
+
+extern int lat_enabled;
+
+static inline uint64_t lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * lat_begin - Start timing an operation
+ *
+ * Return: 0 if recording is disabled, otherwise the current timestamp to be
+ * handed back to lat_end().
+ */
+static inline uint64_t lat_begin(void)
+{
+	if (!lat_enabled)
+		return 0;
+	return lat_now();
+}
+
+void lat_record(enum lat_op op, uint64_t ns);
+
+/**
+ * lat_end - Record the duration of an operation started with lat_begin()
+ * @op: Operation being timed
+ * @start: Value returned by lat_begin()
+ */
+static inline void lat_end(enum lat_op op, uint64_t start)
+{
+	if (start)
+		lat_record(op, lat_now() - start);
+}
+
+/**
+ * lat_op_name - Get the printable name of an operation
+ * @op: Operation
+ *
+ * Return: NULL if @op is out of range, otherwise the name of the function it
+ * stands for.
+ */
+const char *lat_op_name(unsigned int op);
+
+/**
+ * lat_dump - Print count and tail percentiles of every non-empty histogram
+ * @out: Stream to print to
+ */
+void lat_dump(FILE *out);
+
+#endif /* _LATENCY_H */
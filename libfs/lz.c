@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+// after 2^SKIP_SHIFT bytes without a match, advance 2 bytes at a time, then 3...
+#define SKIP_SHIFT 5
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// lengths that do not fit in their token nibble continue in bytes of 255,
+// ended by a byte below 255
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255)
+	{
+		if (op >= oend)
+		{
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if (op >= oend)
+	{
+		return NULL;
+	}
+	*op++ = len;
+	return op;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t byte;
+
+	do
+	{
+		if (*ip >= iend)
+		{
+			return -1;
+		}
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+// append literals followed by a match, or by nothing when @match_len is 0,
+// which only the last sequence does
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, size_t literal_len,
+							 size_t offset, size_t match_len)
+{
+	size_t match_code = match_len != 0 ? match_len - MIN_MATCH : 0;
+
+	if (op >= oend)
+	{
+		return NULL;
+	}
+	*op++ = MIN(literal_len, 15) << 4 | MIN(match_code, 15);
+	if (literal_len >= 15 && (op = put_length(op, oend, literal_len - 15)) == NULL)
+	{
+		return NULL;
+	}
+
+	if ((size_t)(oend - op) < literal_len)
+	{
+		return NULL;
+	}
+	memcpy(op, literals, literal_len);
+	op += literal_len;
+
+	if (match_len == 0)
+	{
+		return op;
+	}
+	if (oend - op < 2)
+	{
+		return NULL;
+	}
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	if (match_code >= 15 && (op = put_length(op, oend, match_code - 15)) == NULL)
+	{
+		return NULL;
+	}
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *in = src;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + cap;
+	uint32_t table[1 << HASH_BITS]; // last position of each hashed 4-byte sequence
+	size_t anchor = 0;
+	size_t ip = 0;
+
+	memset(table, 0xFF, sizeof(table));
+	while (ip + MIN_MATCH <= len)
+	{
+		uint32_t seq = read32(in + ip);
+		uint32_t hash = hash32(seq);
+		size_t ref = table[hash];
+
+		table[hash] = ip;
+		if (ref == UINT32_MAX || ip - ref > MAX_OFFSET || read32(in + ref) != seq)
+		{
+			ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+			continue;
+		}
+
+		// grow the match both ways
+		size_t match_len = MIN_MATCH;
+		while (ip + match_len < len && in[ref + match_len] == in[ip + match_len])
+		{
+			match_len++;
+		}
+		while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1])
+		{
+			ip--;
+			ref--;
+			match_len++;
+		}
+
+		op = put_sequence(op, oend, in + anchor, ip - anchor, ip - ref, match_len);
+		if (op == NULL)
+		{
+			return 0;
+		}
+		ip += match_len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, in + anchor, len - anchor, 0, 0);
+	return op != NULL ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + len;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + cap;
+
+	while (ip < iend)
+	{
+		unsigned int token = *ip++;
+
+		size_t literal_len = token >> 4;
+		if (literal_len == 15 && get_length(&ip, iend, &literal_len) < 0)
+		{
+			return -1;
+		}
+		if (literal_len > (size_t)(iend - ip) || literal_len > (size_t)(oend - op))
+		{
+			return -1;
+		}
+		memcpy(op, ip, literal_len);
+		op += literal_len;
+		ip += literal_len;
+
+		// the last sequence has no match
+		if (ip == iend)
+		{
+			break;
+		}
+
+		if (iend - ip < 2)
+		{
+			return -1;
+		}
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		size_t match_len = token & 15;
+		if (match_len == 15 && get_length(&ip, iend, &match_len) < 0)
+		{
+			return -1;
+		}
+		match_len += MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) || match_len > (size_t)(oend - op))
+		{
+			return -1;
+		}
+
+		// byte by byte, so that overlapping matches repeat their pattern
+		const uint8_t *ref = op - offset;
+		while (match_len-- > 0)
+		{
+			*op++ = *ref++;
+		}
+	}
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,41 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+/**
+ * LZ codec
+ *
+ * A small byte-oriented LZ77 codec in the style of LZ4: the output is a
+ * sequence of (literal run, back-reference) pairs, each introduced by a token
+ * byte holding the literal length and the match length in its two nibbles,
+ * with back-references reaching at most 64 KiB back. Compression favors speed
+ * over ratio, and skips ahead faster and faster over data it cannot find
+ * matches in, so incompressible input is given up on quickly.
+ */
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Length of @src
+ * @dst: Output buffer
+ * @cap: Size of @dst
+ *
+ * Return: 0 if the compressed data does not fit in @cap bytes, otherwise the
+ * length of the compressed data written to @dst.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data produced by lz_compress()
+ * @len: Length of @src
+ * @dst: Output buffer
+ * @cap: Size of @dst
+ *
+ * Return: -1 if @src is malformed or decompresses to more than @cap bytes,
+ * otherwise the length of the decompressed data written to @dst.
+ */
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "pager.h"
+
+int pager_init(struct pager *p, uint32_t start, uint32_t pages, uint32_t max_frames)
+{
+	memset(p, 0, sizeof(*p));
+	p->start = start;
+	p->pages = pages;
+	p->max_frames = max_frames < pages ? max_frames : pages;
+	if (p->max_frames == 0)
+	{
+		p->max_frames = 1;
+	}
+
+	p->slot = calloc(pages ? pages : 1, sizeof(*p->slot));
+	p->frames = calloc(p->max_frames, sizeof(*p->frames));
+	if (p->slot == NULL || p->frames == NULL)
+	{
+		pager_destroy(p);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_back(struct pager *p, struct pager_frame *frame)
+{
+	if (frame->dirty)
+	{
+		if (block_write(p->start + frame->page, frame->data) < 0)
+		{
+			return -1;
+		}
+		frame->dirty = 0;
+	}
+	return 0;
+}
+
+// pick a frame for a new page: a never used one while there are some left,
+// otherwise the first one the CLOCK hand finds not recently referenced
+static struct pager_frame *grab_frame(struct pager *p)
+{
+	if (p->nframes < p->max_frames)
+	{
+		struct pager_frame *frame = &p->frames[p->nframes];
+		frame->data = block_buf_alloc(1);
+		if (frame->data == NULL)
+		{
+			return NULL;
+		}
+		p->nframes++;
+		return frame;
+	}
+
+	for (;;)
+	{
+		struct pager_frame *frame = &p->frames[p->hand];
+		p->hand = (p->hand + 1) % p->nframes;
+
+		if (frame->referenced)
+		{
+			frame->referenced = 0;
+			continue;
+		}
+		if (write_back(p, frame) < 0)
+		{
+			return NULL;
+		}
+		p->slot[frame->page] = 0;
+		return frame;
+	}
+}
+
+void *pager_get(struct pager *p, uint32_t page, int dirty)
+{
+	if (page >= p->pages)
+	{
+		return NULL;
+	}
+
+	struct pager_frame *frame;
+	if (p->slot[page] != 0)
+	{
+		frame = &p->frames[p->slot[page] - 1];
+	}
+	else
+	{
+		frame = grab_frame(p);
+		if (frame == NULL || block_read(p->start + page, frame->data) < 0)
+		{
+			return NULL;
+		}
+		frame->page = page;
+		frame->dirty = 0;
+		p->slot[page] = frame - p->frames + 1;
+	}
+
+	frame->referenced = 1;
+	frame->dirty |= dirty != 0;
+	return frame->data;
+}
+
+int pager_install(struct pager *p, uint32_t page, void *data)
+{
+	if (page >= p->pages || p->slot[page] != 0 || p->nframes == p->max_frames)
+	{
+		return -1;
+	}
+
+	struct pager_frame *frame = &p->frames[p->nframes++];
+	frame->data = data;
+	frame->page = page;
+	frame->dirty = 0;
+	frame->referenced = 0;
+	p->slot[page] = p->nframes;
+	return 0;
+}
+
+int pager_writeback(struct pager *p, struct writeback *wb)
+{
+	// walk the table in order so that the batch needs no sorting
+	for (uint32_t page = 0; page < p->pages; page++)
+	{
+		if (p->slot[page] == 0)
+		{
+			continue;
+		}
+		struct pager_frame *frame = &p->frames[p->slot[page] - 1];
+		if (frame->dirty && wb_add(wb, p->start + page, frame->data, &frame->dirty) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int pager_flush(struct pager *p)
+{
+	struct writeback wb;
+
+	wb_init(&wb);
+	if (pager_writeback(p, &wb) < 0)
+	{
+		return -1;
+	}
+	return wb_submit(&wb);
+}
+
+void pager_destroy(struct pager *p)
+{
+	if (p->frames != NULL)
+	{
+		for (uint32_t i = 0; i < p->nframes; i++)
+		{
+			block_buf_free(p->frames[i].data, 1);
+		}
+	}
+	free(p->frames);
+	free(p->slot);
+	memset(p, 0, sizeof(*p));
+}
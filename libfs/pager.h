@@ -0,0 +1,105 @@
+#ifndef _PAGER_H
+#define _PAGER_H
+
+#include <stdint.h>
+
+#include "writeback.h"
+
+/**
+ * Block pager
+ *
+ * Keeps a bounded number of the blocks of an on-disk table (such as the FAT)
+ * resident in memory. Blocks are read on first access and, once the resident
+ * set is full, evicted in CLOCK order; dirty blocks are written back when
+ * evicted and by pager_flush().
+ *
+ * Pointers returned by pager_get() stay valid until the next call that can
+ * bring another block in, i.e. the next pager_get() on the same pager.
+ */
+
+struct pager_frame
+{
+	void *data;
+	uint32_t page;
+	uint8_t dirty;
+	uint8_t referenced;
+};
+
+struct pager
+{
+	uint32_t start;		 // disk block holding page 0
+	uint32_t pages;		 // table length in blocks
+	uint32_t *slot;		 // per page: index of its frame + 1, 0 when not resident
+	struct pager_frame *frames;
+	uint32_t nframes;	 // frames in use
+	uint32_t max_frames; // resident set bound
+	uint32_t hand;		 // CLOCK hand
+};
+
+/**
+ * pager_init - Set up a pager for a table
+ * @p: Pager
+ * @start: Disk block index of the first block of the table
+ * @pages: Number of blocks in the table
+ * @max_frames: Maximum number of blocks resident at once (at least 1)
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int pager_init(struct pager *p, uint32_t start, uint32_t pages, uint32_t max_frames);
+
+/**
+ * pager_get - Get a table block
+ * @p: Pager
+ * @page: Index of the block within the table
+ * @dirty: Whether the caller is going to modify the block
+ *
+ * Return: NULL if @page is out of range or cannot be read, otherwise the
+ * content of the block.
+ */
+void *pager_get(struct pager *p, uint32_t page, int dirty);
+
+/**
+ * pager_install - Hand an already read block over to the pager
+ * @p: Pager
+ * @page: Index of the block within the table
+ * @data: Buffer from block_buf_alloc() holding the content of the block
+ *
+ * Make @data the resident copy of @page, if the resident set has room for it.
+ *
+ * Return: -1 if @data was not taken (the caller keeps ownership of it). 0 if
+ * the pager now owns @data.
+ */
+int pager_install(struct pager *p, uint32_t page, void *data);
+
+/**
+ * pager_writeback - Queue all dirty blocks for writing
+ * @p: Pager
+ * @wb: Write-back batch
+ *
+ * The blocks are marked clean as @wb writes them, so that several tables can
+ * be flushed with merged writes. @wb must be submitted before the next
+ * pager_get() on @p.
+ *
+ * Return: -1 if a full batch cannot be submitted. 0 otherwise.
+ */
+int pager_writeback(struct pager *p, struct writeback *wb);
+
+/**
+ * pager_flush - Write all dirty blocks back to disk
+ * @p: Pager
+ *
+ * Adjacent dirty blocks are written with a single system call.
+ *
+ * Return: -1 if a block cannot be written. 0 otherwise.
+ */
+int pager_flush(struct pager *p);
+
+/**
+ * pager_destroy - Release all the memory held by a pager
+ * @p: Pager
+ *
+ * Dirty blocks are dropped, call pager_flush() first to keep them.
+ */
+void pager_destroy(struct pager *p);
+
+#endif /* _PAGER_H */
@@ -0,0 +1,113 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "latency.h"
+#include "trace.h"
+
+// records buffered in memory before each write to the trace file
+#define TRACE_BUF_RECORDS 4096
+
+int trace_enabled;
+__thread uint8_t trace_op = TRACE_OP_NONE;
+
+static FILE *trace_file;
+static uint64_t trace_epoch;
+static struct trace_record trace_buf[TRACE_BUF_RECORDS];
+static size_t trace_len;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__((constructor)) static void trace_init(void)
+{
+	const char *path = getenv("FS_TRACE");
+	if (path == NULL || *path == '\0')
+	{
+		return;
+	}
+
+	trace_file = fopen(path, "wb");
+	if (trace_file == NULL)
+	{
+		perror("FS_TRACE");
+		return;
+	}
+
+	struct trace_header header = {.block_size = BLOCK_SIZE};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	if (fwrite(&header, sizeof(header), 1, trace_file) != 1)
+	{
+		perror("FS_TRACE");
+		fclose(trace_file);
+		trace_file = NULL;
+		return;
+	}
+
+	trace_epoch = lat_now();
+	trace_enabled = 1;
+}
+
+// caller must hold trace_lock
+static void trace_write_out(void)
+{
+	if (trace_len && fwrite(trace_buf, sizeof(trace_buf[0]), trace_len, trace_file) != trace_len)
+	{
+		perror("FS_TRACE");
+	}
+	trace_len = 0;
+	fflush(trace_file);
+}
+
+void trace_block(size_t block, enum trace_dir dir)
+{
+	struct trace_record rec = {
+		.time_ns = lat_now() - trace_epoch,
+		.block = block,
+		.dir = dir,
+		.op = trace_op,
+	};
+
+	pthread_mutex_lock(&trace_lock);
+	trace_buf[trace_len++] = rec;
+	if (trace_len == TRACE_BUF_RECORDS)
+	{
+		trace_write_out();
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_block_size(size_t size)
+{
+	uint32_t block_size = size;
+
+	// the header is rewritten in place once everything before it is out,
+	// records going on after it
+	pthread_mutex_lock(&trace_lock);
+	trace_write_out();
+	if (pwrite(fileno(trace_file), &block_size, sizeof(block_size), offsetof(struct trace_header, block_size)) !=
+		sizeof(block_size))
+	{
+		perror("FS_TRACE");
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_flush(void)
+{
+	if (!trace_enabled)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	trace_write_out();
+	pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((destructor)) static void trace_fini(void)
+{
+	trace_flush();
+}
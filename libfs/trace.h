@@ -0,0 +1,62 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Block I/O tracing
+ *
+ * When the environment variable FS_TRACE names a file, every block_read() and
+ * block_write() issued by the process is appended to it as a fixed-size
+ * binary record. The file starts with one struct trace_header followed by a
+ * flat array of struct trace_record, all little-endian.
+ */
+
+#define TRACE_MAGIC "FSTRACE1"
+
+/* Value of trace_record.op for I/O issued outside of any fs_*() call */
+#define TRACE_OP_NONE 0xFF
+
+enum trace_dir
+{
+	TRACE_READ,
+	TRACE_WRITE
+};
+
+struct trace_header
+{
+	char magic[8];		 // TRACE_MAGIC, not NULL-terminated
+	uint32_t block_size; // block size of the traced disk, the last one set
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct trace_record
+{
+	uint64_t time_ns; // time since the trace was started
+	uint32_t block;	  // block index on disk
+	uint8_t dir;	  // enum trace_dir
+	uint8_t op;		  // enum lat_op of the calling fs_*() function
+	uint16_t reserved;
+} __attribute__((packed));
+
+extern int trace_enabled;
+
+/* Operation currently executed by the calling thread (enum lat_op) */
+extern __thread uint8_t trace_op;
+
+void trace_block(size_t block, enum trace_dir dir);
+
+/**
+ * trace_block_size - Record the block size of the traced disk
+ * @size: Block size in bytes, which the block indices recorded from now on
+ * count in
+ */
+void trace_block_size(size_t size);
+
+/**
+ * trace_flush - Write buffered records out to the trace file
+ */
+void trace_flush(void);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "writeback.h"
+
+void wb_init(struct writeback *wb)
+{
+	wb->count = 0;
+}
+
+int wb_add(struct writeback *wb, uint32_t block, void *data, uint8_t *dirty)
+{
+	if (wb->count == WB_BATCH_MAX && wb_submit(wb) < 0)
+	{
+		return -1;
+	}
+	wb->req[wb->count++] = (struct wb_req){block, data, dirty};
+	return 0;
+}
+
+static int req_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const struct wb_req *)a)->block;
+	uint32_t y = ((const struct wb_req *)b)->block;
+	return (x > y) - (x < y);
+}
+
+static int is_sorted(const struct writeback *wb)
+{
+	for (uint32_t i = 1; i < wb->count; i++)
+	{
+		if (wb->req[i - 1].block > wb->req[i].block)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int wb_submit(struct writeback *wb)
+{
+	// flushes mostly queue blocks in order already
+	if (!is_sorted(wb))
+	{
+		qsort(wb->req, wb->count, sizeof(wb->req[0]), req_cmp);
+	}
+
+	int ret = 0;
+	for (uint32_t i = 0; i < wb->count;)
+	{
+		struct iovec iov[WB_RUN_MAX];
+		uint32_t run = 0;
+		do
+		{
+			iov[run].iov_base = wb->req[i + run].data;
+			iov[run].iov_len = block_disk_block_size();
+			run++;
+		} while (run < WB_RUN_MAX && i + run < wb->count && wb->req[i + run].block == wb->req[i].block + run);
+
+		int written = run == 1 ? block_write(wb->req[i].block, iov[0].iov_base)
+							   : block_writev(wb->req[i].block, iov, run);
+		if (written < 0)
+		{
+			ret = -1;
+		}
+		else
+		{
+			for (uint32_t j = i; j < i + run; j++)
+			{
+				if (wb->req[j].dirty != NULL)
+				{
+					*wb->req[j].dirty = 0;
+				}
+			}
+		}
+		i += run;
+	}
+
+	wb->count = 0;
+	return ret;
+}
@@ -0,0 +1,59 @@
+#ifndef _WRITEBACK_H
+#define _WRITEBACK_H
+
+#include <stdint.h>
+
+/**
+ * Write-back scheduler
+ *
+ * Collects block writes that may be issued in any order, such as the dirty
+ * blocks of a flush, and issues them sorted by block number, runs of adjacent
+ * blocks being merged into single block_writev() calls of at most
+ * WB_RUN_MAX blocks. At most WB_BATCH_MAX writes are held at once: adding
+ * one more submits the batch first. The buffers of the writes must stay as
+ * they are until their batch is submitted.
+ */
+
+#define WB_BATCH_MAX 1024
+#define WB_RUN_MAX 256
+
+struct wb_req
+{
+	uint32_t block;
+	void *data;
+	uint8_t *dirty; // cleared once the block is written, may be NULL
+};
+
+struct writeback
+{
+	struct wb_req req[WB_BATCH_MAX];
+	uint32_t count;
+};
+
+/**
+ * wb_init - Set up an empty batch
+ * @wb: Batch
+ */
+void wb_init(struct writeback *wb);
+
+/**
+ * wb_add - Queue a block write
+ * @wb: Batch
+ * @block: Disk block index
+ * @data: Content of the block
+ * @dirty: Flag to clear once the block is written, or NULL
+ *
+ * Return: -1 if the batch was full and could not be submitted. 0 otherwise.
+ */
+int wb_add(struct writeback *wb, uint32_t block, void *data, uint8_t *dirty);
+
+/**
+ * wb_submit - Write out all the queued blocks
+ * @wb: Batch, empty afterwards
+ *
+ * Return: -1 if a block cannot be written, in which case the dirty flags of
+ * the blocks that were not written stay set. 0 otherwise.
+ */
+int wb_submit(struct writeback *wb);
+
+#endif /* _WRITEBACK_H */